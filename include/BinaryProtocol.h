@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <EventBus.h>
+#include <MotorCommand.h>
+
+// Opt-in binary frames for /ws, negotiated by sending {"type":"protocol","binary":true}
+// Frames start with the frame type, all numbers are little-endian int32 (unless noted)
+//   move        0x01: position, speed, acceleration, jerk (mm, mm/s, mm/ss, mm/sss)
+//   stop        0x02
+//   home        0x03
+//   jog         0x04: speed (signed), acceleration (mm/s, mm/ss, 0 for the last used)
+//   move_state  0x81: position, speed, current scale (uint8, CS_ACTUAL 0..31)
+//   motor_state 0x82: state (uint8), flags (uint8), origin, move_state position, speed,
+//                     destination position, speed, acceleration, jerk
+//                     (flags: bit 0 move_state is valid, bit 1 destination is valid)
+// Everything else (warnings, errors, jogging, config,...) is still sent as JSON
+class BinaryProtocol {
+  public:
+    enum FrameType : uint8_t {
+      MOVE = 0x01,
+      STOP = 0x02,
+      HOME = 0x03,
+      JOG = 0x04,
+      MOVE_STATE = 0x81,
+      MOTOR_STATE = 0x82
+    };
+
+    enum MotorStateFlags : uint8_t {
+      HAS_MOVE_STATE = 0x01,
+      HAS_DESTINATION = 0x02
+    };
+
+    static constexpr size_t MAX_FRAME_LENGTH = 1 + 2 + 7 * 4;
+
+    // returns the length of the frame, or 0 if the event can't be sent binary
+    static size_t encodeEvent(const MotorEvent& event, uint8_t* frame);
+    static bool decodeCommand(const uint8_t* frame, size_t length, int32_t clientID, MotorCommand* command);
+
+  private:
+    static uint8_t* _putInt32(uint8_t* frame, int32_t value);
+    static int32_t _getInt32(const uint8_t* frame);
+};
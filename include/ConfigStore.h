@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <TaskSchedulerDeclarations.h>
+
+#include <functional>
+#include <mutex>
+
+// Changes are written to NVS after being quiet for a while (ms)
+#ifndef CONFIG_FLUSH_MS
+  #define CONFIG_FLUSH_MS 2000
+#endif
+
+// Homed position, retained in RTC memory (soft restarts) and a NVS journal (power-on)
+struct PositionRecord {
+    static constexpr uint32_t MAGIC = 0x54445250;
+    uint32_t magic;
+    int32_t position; // in µSteps
+    uint16_t microstepCounter;
+    uint8_t homed;
+    uint8_t holding;    // motor was enabled with holding current
+    uint8_t standstill; // not moving since recorded
+    uint32_t crc;
+};
+
+// Keeps the persistent settings in RAM and writes them behind as one versioned blob
+class ConfigStore {
+  public:
+    // bump the version when changing the layout (new fields are appended and listed in _payloadSize, older blobs keep their defaults)
+    struct Config {
+        static constexpr uint16_t VERSION = 8;
+        uint16_t version;
+        int32_t speed;        // mm/s
+        int32_t acceleration; // mm/ss
+        bool autoHome;
+        bool holdPosition;
+        uint32_t jogTimeout;       // ms
+        uint32_t positionDeadband; // mm
+        uint32_t speedDeadband;    // mm/s
+        uint8_t pwmGradient;
+        uint8_t pwmOffset;
+        uint32_t pwmHash; // 0 when not calibrated
+        // version 2
+        uint8_t homingMode; // Stepper::HomingMode
+        uint8_t stallThreshold;
+        int32_t strokeLength; // mm, 0 when not measured
+        // version 3
+        int32_t maxSpeed;        // mm/s, 0 without a limit
+        int32_t maxAcceleration; // mm/ss, 0 without a limit
+        // version 4
+        uint32_t stealthChopThreshold; // TPWMTHRS
+        uint32_t coolStepThreshold;    // TCOOLTHRS, 0 without CoolStep
+        // version 5
+        uint8_t shaper;        // MotionPlanner::Shaper
+        float shaperFrequency; // Hz
+        float shaperDamping;
+        // version 6
+        uint64_t resonanceMap; // bins of RESONANCE_SPEED_STEP, 0 when not mapped
+        // version 7
+        uint8_t coolStepMin;         // SEMIN, 0 without CoolStep
+        uint8_t coolStepMax;         // SEMAX
+        uint8_t currentAcceleration; // % of TMC_RMS_CURRENT
+        uint8_t currentCruise;
+        uint8_t currentHold;
+        // version 8
+        uint8_t stallPolicy; // Stepper::StallPolicy
+    };
+
+    // writing is postponed while busy (NVS writes block the task)
+    typedef std::function<bool()> BusyCallback;
+    void begin(Scheduler* scheduler, BusyCallback busy = nullptr);
+    // flushes pending changes
+    void end();
+    const Config& get() const { return _config; }
+    // the returned config is written after CONFIG_FLUSH_MS without further changes
+    Config& edit();
+    const PositionRecord& getJournal() const { return _journal; }
+    // journal updates and flushing are serialized (edits are done by the scheduler's task only)
+    void setJournal(const PositionRecord& journal);
+    void flush();
+
+  private:
+    Scheduler* _scheduler = nullptr;
+    Config _config = {};
+    PositionRecord _journal = {};
+    bool _configDirty = false;
+    bool _journalDirty = false;
+    Task* _flushTask = nullptr;
+    BusyCallback _busy = nullptr;
+    void _flushBehind();
+    std::mutex _mutex;
+    void _touch();
+    static Config _defaults();
+    static size_t _payloadSize(uint16_t version);
+    void _migrate();
+};
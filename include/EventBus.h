@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <TaskSchedulerDeclarations.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// Max. number of events waiting for being dispatched
+#ifndef EVENT_BUS_CAPACITY
+  #define EVENT_BUS_CAPACITY 32
+#endif
+
+// Event published by the stepper, serialized by the subscribers (websocket,...)
+// position, speed, acceleration, jerk in mm, mm/s, mm/ss, mm/sss
+struct MotorEvent {
+    enum class Type : uint8_t {
+      MOTOR_STATE,
+      MOVE_STATE,
+      CONFIG,
+      THERMAL
+    };
+    static constexpr uint8_t TYPE_COUNT = 4;
+
+    // optional parts of a MOTOR_STATE event
+    enum Parts : uint8_t {
+      ORIGIN = 0x01,
+      MOVE_STATE = 0x02,
+      DESTINATION = 0x04,
+      JOG = 0x08,
+      WAYPOINTS = 0x10
+    };
+
+    Type type;
+    uint8_t state;      // Stepper::MotorState
+    uint8_t motorState; // Stepper::MotorState when published (state might be a temporary one)
+    uint8_t parts;
+    int32_t origin;
+    // static strings only
+    const char* warning;
+    const char* error;
+    struct {
+        int32_t position;
+        int32_t speed;
+        uint8_t currentScale; // CS_ACTUAL (0..31), as last sampled by the telemetry
+    } moveState;
+    struct {
+        int32_t position;
+        int32_t speed;
+        int32_t acceleration;
+        int32_t jerk;
+    } destination;
+    struct {
+        int32_t speed;
+        int32_t acceleration;
+    } jog;
+    uint16_t waypoints;
+    struct {
+        bool autoHome;
+        uint32_t jogTimeout;
+        uint32_t positionDeadband;
+        uint32_t speedDeadband;
+        bool holdPosition;
+        uint8_t homingMode; // Stepper::HomingMode
+        uint8_t stallThreshold;
+        int32_t strokeLength; // mm, 0 when not measured
+        int32_t maxSpeed;     // 0 without a limit
+        int32_t maxAcceleration;
+        uint32_t stealthChopThreshold; // TSTEP
+        uint32_t coolStepThreshold;    // TSTEP, 0 without CoolStep
+        uint8_t shaper;                // MotionPlanner::Shaper
+        float shaperFrequency;         // Hz
+        float shaperDamping;
+        uint64_t resonanceMap;       // bit n: n * RESONANCE_SPEED_STEP mm/s is resonant
+        uint8_t coolStepMin;         // SEMIN, 0 without CoolStep
+        uint8_t coolStepMax;         // SEMAX
+        uint8_t currentAcceleration; // % of the rated current
+        uint8_t currentCruise;
+        uint8_t currentHold;
+        uint8_t stallPolicy; // Stepper::StallPolicy
+    } config;
+    struct {
+        uint8_t state;    // Stepper::ThermalState
+        uint8_t derating; // % of current and acceleration
+        int32_t maxSpeed; // mm/s, 0 without a limit
+        int32_t maxAcceleration;
+    } thermal;
+
+    void setOrigin(int32_t clientID) {
+      parts |= ORIGIN;
+      origin = clientID;
+    }
+    void setMoveState(int32_t position, int32_t speed, uint8_t currentScale) {
+      parts |= MOVE_STATE;
+      moveState = {position, speed, currentScale};
+    }
+    void setDestination(int32_t position, int32_t speed, int32_t acceleration, int32_t jerk) {
+      parts |= DESTINATION;
+      destination = {position, speed, acceleration, jerk};
+    }
+};
+
+class EventBus {
+  public:
+    EventBus() { _sr.setWaiting(); }
+    void begin(Scheduler* scheduler);
+    void end();
+    typedef std::function<void(const MotorEvent& event)> Subscriber;
+    void subscribe(Subscriber subscriber) { _subscribers.push_back(subscriber); }
+    // can be called from any task, telemetry (MOVE_STATE) is coalesced to the latest one
+    // (when the queue is full, the event is dropped and the snapshots are sent again instead)
+    bool publish(const MotorEvent& event);
+    uint32_t getDropped() { return _dropped; }
+    // latest event of a type (for clients connecting), the parts of MOTOR_STATE are merged
+    MotorEvent getSnapshot(MotorEvent::Type type);
+
+  private:
+    Scheduler* _scheduler = nullptr;
+    QueueHandle_t _queue = nullptr;
+    StatusRequest _sr;
+    Task* _dispatchTask = nullptr;
+    void _dispatchCallback();
+    std::vector<Subscriber> _subscribers;
+    uint32_t _dropped = 0;
+    std::atomic<bool> _moveStatePending{false};
+    std::atomic<bool> _resyncPending{false};
+    MotorEvent _snapshots[MotorEvent::TYPE_COUNT] = {};
+    portMUX_TYPE _snapshotMux = portMUX_INITIALIZER_UNLOCKED;
+    void _updateSnapshot(const MotorEvent& event);
+};
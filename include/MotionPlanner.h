@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <FastAccelStepper.h>
+
+#include <vector>
+
+// Duration of one command in FastAccelStepper's queue (4ms, must fit into uint16_t ticks)
+#ifndef PLANNER_SLICE_TICKS
+  #define PLANNER_SLICE_TICKS (TICKS_PER_S / 250)
+#endif
+
+// Keep this many ticks queued in FastAccelStepper (~60ms)
+#ifndef PLANNER_FILL_TICKS
+  #define PLANNER_FILL_TICKS (TICKS_PER_S / 16)
+#endif
+
+// Interval for refilling FastAccelStepper's queue
+#ifndef PLANNER_FEED_MS
+  #define PLANNER_FEED_MS 10
+#endif
+
+#ifndef PLANNER_MAX_WAYPOINTS
+  #define PLANNER_MAX_WAYPOINTS 32
+#endif
+
+// Tolerated vibration of the EI shaper (share of the unshaped one)
+#ifndef PLANNER_EI_TOLERANCE
+  #define PLANNER_EI_TOLERANCE 0.05f
+#endif
+
+class MotionPlanner {
+  public:
+    // position, speed, acceleration in steps, steps/s, steps/ss
+    struct Waypoint {
+      int32_t position;
+      uint32_t speed;
+      uint32_t acceleration;
+    };
+
+    // input shapers, the profile is convolved with impulses delayed by fractions of the resonance's period
+    enum class Shaper : uint8_t {
+      NONE,
+      ZV,
+      ZVD,
+      EI
+    };
+
+    // for the following plans, frequency in Hz, damping ratio in (0, 1)
+    void setShaper(Shaper shaper, float frequency, float damping);
+    bool isShaping() { return _impulseCount > 1; }
+    // jerk in steps/sss, 0 gives trapezoidal profiles
+    bool plan(int32_t startPosition, const std::vector<Waypoint>& waypoints, uint32_t jerk = 0);
+    bool fill(FastAccelStepper* stepper);
+    // ramp down from the stepper's actual position and speed
+    void stop(FastAccelStepper* stepper, uint32_t acceleration);
+    void abort();
+    bool isActive() { return _active; }
+    bool isCountingUp() { return _countUp; }
+    int32_t getTargetPosition() { return _targetPosition; }
+
+  private:
+    // part of the profile with constant jerk
+    struct Phase {
+      float start;
+      float duration;
+      float position;
+      float speed;
+      float acceleration;
+      float jerk;
+    };
+    // state at the end of the profile while planning
+    struct State {
+      float position;
+      float speed;
+      float acceleration;
+    };
+    struct Impulse {
+      float time;
+      float amplitude;
+    };
+    std::vector<Phase> _phases;
+    float _duration = 0;
+    float _jerk = 0;
+    Impulse _impulses[3] = {{0, 1}};
+    uint8_t _impulseCount = 1;
+    // the current profile is shaped (stopping isn't)
+    bool _shaped = false;
+    // cursor into the profile for the next command
+    float _time = 0;
+    int32_t _emittedPosition = 0;
+    int32_t _targetPosition = 0;
+    // command that was rejected by FastAccelStepper, to be added again
+    stepper_command_s _pendingCommand;
+    float _pendingTime = 0;
+    bool _hasPendingCommand = false;
+    bool _countUp = true;
+    bool _active = false;
+    float _rampTime(float fromSpeed, float toSpeed, float acceleration);
+    float _rampDistance(float fromSpeed, float toSpeed, float acceleration);
+    float _reachableSpeed(float fromSpeed, float length, float acceleration);
+    void _addPhase(State* state, float duration, float jerk);
+    void _addRamp(State* state, float direction, float toSpeed, float acceleration);
+    void _addSegment(int32_t from, int32_t to, float entrySpeed, float exitSpeed, float maxSpeed, float acceleration);
+    float _endTime();
+    const Phase& _phaseAt(float time);
+    float _positionAt(float time);
+    float _speedAt(float time);
+    bool _nextCommand();
+};
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <MotionPlanner.h>
+
+// Max. number of commands waiting for the stepper (power of 2)
+#ifndef COMMAND_QUEUE_CAPACITY
+  #define COMMAND_QUEUE_CAPACITY 8
+#endif
+
+// Waypoint of a sequence, position, speed, acceleration in mm, mm/s, mm/ss
+// (converted to MotionPlanner's steps by Stepper::start_sequence)
+struct MotorWaypoint {
+    int32_t position;
+    int32_t speed;
+    int32_t acceleration;
+};
+
+// Command for the stepper, parsed by the web layer (JSON, binary frames,...)
+// position, speed, acceleration, jerk in mm, mm/s, mm/ss, mm/sss
+struct MotorCommand {
+    enum class Type : uint8_t {
+      UNKNOWN,
+      MOVE,
+      MOVE_SEQUENCE,
+      JOG,
+      STOP,
+      HOME,
+      CALIBRATE,
+      UPDATE_CONFIG,
+      CHARACTERIZE,
+      TUNE_CHOPPER,
+      CALIBRATE_SHAPER,
+      MAP_RESONANCES
+    };
+
+    // optional values which were given
+    enum Options : uint32_t {
+      SPEED = 0x01,
+      ACCELERATION = 0x02,
+      AUTO_HOME = 0x04,
+      JOG_TIMEOUT = 0x08,
+      POSITION_DEADBAND = 0x10,
+      SPEED_DEADBAND = 0x20,
+      HOLD_POSITION = 0x40,
+      HOMING_MODE = 0x80,
+      STALL_THRESHOLD = 0x100,
+      MAX_SPEED = 0x200,
+      MAX_ACCELERATION = 0x400,
+      CHOPPER_MODE = 0x800,
+      SHAPER = 0x1000,
+      SHAPER_FREQUENCY = 0x2000,
+      SHAPER_DAMPING = 0x4000,
+      RESONANCE_MAP = 0x8000,
+      COOLSTEP_MIN = 0x10000,
+      COOLSTEP_MAX = 0x20000,
+      CURRENT_ACCELERATION = 0x40000,
+      CURRENT_CRUISE = 0x80000,
+      CURRENT_HOLD = 0x100000,
+      STALL_POLICY = 0x200000,
+      STROKE_LENGTH = 0x400000
+    };
+
+    Type type;
+    uint32_t options;
+    int32_t origin;
+    int32_t position;
+    int32_t speed;
+    int32_t acceleration;
+    int32_t jerk;
+    uint8_t chopperMode; // Stepper::ChopperMode of a move, sequence or jogging
+    struct {
+        bool autoHome;
+        uint32_t jogTimeout;
+        uint32_t positionDeadband;
+        uint32_t speedDeadband;
+        bool holdPosition;
+        uint8_t homingMode; // Stepper::HomingMode
+        uint8_t stallThreshold;
+        int32_t maxSpeed;        // 0 removes the limit
+        int32_t maxAcceleration; // 0 removes the limit
+        uint8_t shaper;          // MotionPlanner::Shaper
+        float shaperFrequency;   // Hz
+        float shaperDamping;
+        uint64_t resonanceMap;       // 0 clears the map
+        uint8_t coolStepMin;         // SEMIN, 0 disables CoolStep
+        uint8_t coolStepMax;         // SEMAX
+        uint8_t currentAcceleration; // % of the rated current
+        uint8_t currentCruise;
+        uint8_t currentHold;
+        uint8_t stallPolicy;  // Stepper::StallPolicy
+        int32_t strokeLength; // mm, 0 when unknown
+    } config;
+    // waypoints without speed or acceleration (0) use the ones of the sequence
+    // (the count might exceed PLANNER_MAX_WAYPOINTS, only those are stored)
+    uint16_t waypointCount;
+    MotorWaypoint waypoints[PLANNER_MAX_WAYPOINTS];
+};
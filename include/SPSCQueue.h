@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free queue for exactly one producer and one consumer task
+template <typename T, size_t Capacity>
+class SPSCQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+  public:
+    // producer only, the item is dropped when the queue is full
+    bool push(const T& item) {
+      size_t head = _head.load(std::memory_order_relaxed);
+      if (head - _tail.load(std::memory_order_acquire) >= Capacity) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      _items[head % Capacity] = item;
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    // consumer only
+    bool pop(T* item) {
+      size_t tail = _tail.load(std::memory_order_relaxed);
+      if (tail == _head.load(std::memory_order_acquire))
+        return false;
+      *item = _items[tail % Capacity];
+      _tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    size_t depth() const { return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire); }
+    uint32_t getDropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+  private:
+    T _items[Capacity];
+    std::atomic<size_t> _head{0};
+    std::atomic<size_t> _tail{0};
+    std::atomic<uint32_t> _dropped{0};
+};
@@ -5,17 +5,239 @@
 #pragma once
 
 #include <ArduinoJson.h>
+#include <ConfigStore.h>
+#include <EventBus.h>
 #include <FastAccelStepper.h>
-#include <TMC2209.h>
+#include <MotionPlanner.h>
+#include <MotorCommand.h>
+#include <SPSCQueue.h>
+#include <TMC2209Driver.h>
 #include <TaskSchedulerDeclarations.h>
+#include <esp_timer.h>
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <string>
+#include <vector>
 
 #define DECREASING false
 #define INCREASING true
 
+// Optionally, the stepper runs on its own scheduler in a dedicated FreeRTOS task (see main.cpp)
+#ifdef MOTION_TASK
+  #ifndef MOTION_TASK_PRIORITY
+    #define MOTION_TASK_PRIORITY 11
+  #endif
+  #ifndef MOTION_TASK_STACK_SIZE
+    #define MOTION_TASK_STACK_SIZE 8192
+  #endif
+  // pinned to the core which is not running AsyncTCP (if there are two of them)
+  #ifndef MOTION_TASK_CORE
+    #if CONFIG_FREERTOS_UNICORE
+      #define MOTION_TASK_CORE tskNO_AFFINITY
+    #else
+      #define MOTION_TASK_CORE (CONFIG_ASYNC_TCP_RUNNING_CORE == 0 ? 1 : 0)
+    #endif
+  #endif
+#endif
+
+// Motor current (mA RMS) and sense resistors (Ohm) of the TMC2209
+#ifndef TMC_RMS_CURRENT
+  #define TMC_RMS_CURRENT 1414
+#endif
+#ifndef TMC_R_SENSE
+  #define TMC_R_SENSE 0.11f
+#endif
+
+// Two-phase homing at the switch: fast approach, back off and slow re-approach
+// speeds in µSteps/(1000s), acceleration in µSteps/ss, distances in mm
+#ifndef HOMING_FAST_SPEED
+  #define HOMING_FAST_SPEED 40000000
+#endif
+#ifndef HOMING_FAST_ACCELERATION
+  #define HOMING_FAST_ACCELERATION 400000
+#endif
+#ifndef HOMING_CREEP_SPEED
+  #define HOMING_CREEP_SPEED 2000000
+#endif
+#ifndef HOMING_BACKOFF_MM
+  #define HOMING_BACKOFF_MM 3
+#endif
+// with a known home, the fast move stops this far before it
+#ifndef HOMING_CREEP_MM
+  #define HOMING_CREEP_MM 2
+#endif
+
+// StealthChop below and CoolStep above the speed (until tuned), thresholds given in TSTEP
+#ifndef STEALTHCHOP_THRSH
+  #define STEALTHCHOP_THRSH 46
+#endif
+#ifndef COOLSTEP_THRSH
+  #define COOLSTEP_THRSH 234
+#endif
+// CoolStep window (SEMIN, SEMAX) and the internal clock of the TMC2209 (Hz)
+#ifndef COOLSTEP_SEMIN
+  #define COOLSTEP_SEMIN 5
+#endif
+#ifndef COOLSTEP_SEMAX
+  #define COOLSTEP_SEMAX 2
+#endif
+#ifndef TMC_CLOCK
+  #define TMC_CLOCK 12000000
+#endif
+// Current schedule (% of TMC_RMS_CURRENT): while the speed changes, at cruise and at standstill (IHOLD)
+#ifndef CURRENT_ACCELERATION_PERCENT
+  #define CURRENT_ACCELERATION_PERCENT 100
+#endif
+#ifndef CURRENT_CRUISE_PERCENT
+  #define CURRENT_CRUISE_PERCENT 70
+#endif
+#ifndef CURRENT_HOLD_PERCENT
+  #define CURRENT_HOLD_PERCENT 50
+#endif
+// highest boost (IRUN is limited to 31 anyway)
+#ifndef CURRENT_BOOST_MAX_PERCENT
+  #define CURRENT_BOOST_MAX_PERCENT 125
+#endif
+// Thermal derating by the temperature flags of DRV_STATUS (% of the current, the acceleration and its cap, the speed
+// and its cap are lowered by half of it), stepped back after staying below a threshold for THERMAL_COOLDOWN_MS
+#ifndef THERMAL_WARM_PERCENT
+  #define THERMAL_WARM_PERCENT 85
+#endif
+#ifndef THERMAL_HOT_PERCENT
+  #define THERMAL_HOT_PERCENT 70
+#endif
+#ifndef THERMAL_CRITICAL_PERCENT
+  #define THERMAL_CRITICAL_PERCENT 50
+#endif
+#ifndef THERMAL_COOLDOWN_MS
+  #define THERMAL_COOLDOWN_MS 10000
+#endif
+// Tuning the thresholds, from the lowest speed (mm/s) while PWM_SCALE_SUM leaves headroom for StealthChop
+#ifndef CHOPPER_TUNE_SPEED_START
+  #define CHOPPER_TUNE_SPEED_START 5
+#endif
+#ifndef CHOPPER_PWM_LIMIT
+  #define CHOPPER_PWM_LIMIT 200
+#endif
+
+// Fast moves use coarser µSteps (MRES), switched at standstill on a full step (speed in mm/s)
+// positions are kept in µSteps of USTEPS_PER_STEP, the remainder is driven with those
+#ifndef USTEPS_FAST
+  #define USTEPS_FAST 4
+#endif
+#ifndef USTEPS_FAST_SPEED
+  #define USTEPS_FAST_SPEED 100
+#endif
+// MSCNT counts 1024 per electrical period, full steps are at 45° (128, 384, 640, 896)
+#define MSCNT_PER_FULL_STEP 256
+#define MSCNT_FULL_STEP 128
+
+// Sensorless homing against the hard stop, speed in µSteps/(1000s), acceleration in µSteps/ss
+#ifndef STALL_HOMING_SPEED
+  #define STALL_HOMING_SPEED 26666666
+#endif
+#ifndef STALL_HOMING_ACCELERATION
+  #define STALL_HOMING_ACCELERATION 266666
+#endif
+// Default SGTHRS, DIAG signals a stall when SG_RESULT falls below twice the threshold
+#ifndef STALL_HOMING_THRESHOLD
+  #define STALL_HOMING_THRESHOLD 80
+#endif
+// Stall monitoring while moving, SG_RESULT is read at a fixed rate (ms) and compared with the threshold of sensorless
+// homing scaled by the speed (StealthChop only, from the minimal speed in mm/s), consecutive samples below are a stall
+#ifndef STALL_MONITOR_MS
+  #define STALL_MONITOR_MS 20
+#endif
+#ifndef STALL_MONITOR_SPEED_MIN
+  #define STALL_MONITOR_SPEED_MIN 10
+#endif
+#ifndef STALL_MONITOR_SAMPLES
+  #define STALL_MONITOR_SAMPLES 2
+#endif
+// a stalled move is retried this often after homing again (with the policy RETRY)
+#ifndef STALL_RETRIES
+  #define STALL_RETRIES 1
+#endif
+// Characterization of the speed and acceleration limits by increasing test moves (mm/s, mm/ss)
+#ifndef CHARACTERIZE_SPEED_START
+  #define CHARACTERIZE_SPEED_START 50
+#endif
+#ifndef CHARACTERIZE_SPEED_MAX
+  #define CHARACTERIZE_SPEED_MAX 400
+#endif
+#ifndef CHARACTERIZE_ACCELERATION_START
+  #define CHARACTERIZE_ACCELERATION_START 500
+#endif
+#ifndef CHARACTERIZE_ACCELERATION_MAX
+  #define CHARACTERIZE_ACCELERATION_MAX 20000
+#endif
+// deviation at the home switch which counts as lost steps (µSteps)
+#ifndef CHARACTERIZE_STEP_LOSS
+  #define CHARACTERIZE_STEP_LOSS (2 * USTEPS_PER_STEP)
+#endif
+// share of the highest passed values which is enforced (%)
+#ifndef CHARACTERIZE_MARGIN
+  #define CHARACTERIZE_MARGIN 80
+#endif
+// Interval for sampling the load while characterizing (ms)
+#ifndef CHARACTERIZE_SAMPLE_MS
+  #define CHARACTERIZE_SAMPLE_MS 20
+#endif
+// Resonance map of the cruise speeds in bins of RESONANCE_SPEED_STEP (mm/s), a bin is resonant when SG_RESULT
+// fluctuates by more than RESONANCE_SG_VARIATION (% of its mean) or PWM_SCALE_SUM peaks above its neighbours
+#ifndef RESONANCE_SPEED_STEP
+  #define RESONANCE_SPEED_STEP 10
+#endif
+#ifndef RESONANCE_SG_VARIATION
+  #define RESONANCE_SG_VARIATION 15
+#endif
+#ifndef RESONANCE_PWM_PEAK
+  #define RESONANCE_PWM_PEAK 8
+#endif
+#define RESONANCE_BINS 64
+
+// Input shaper (until calibrated), resonance in Hz and its damping ratio
+#ifndef SHAPER_DEFAULT_FREQUENCY
+  #define SHAPER_DEFAULT_FREQUENCY 20.0f
+#endif
+#ifndef SHAPER_DEFAULT_DAMPING
+  #define SHAPER_DEFAULT_DAMPING 0.1f
+#endif
+// Calibration oscillates with this acceleration (mm/ss) at increasing frequencies (Hz),
+// the strongest load (lowest SG_RESULT) is taken as the resonance
+#ifndef SHAPER_CALIBRATE_ACCELERATION
+  #define SHAPER_CALIBRATE_ACCELERATION 2000
+#endif
+#ifndef SHAPER_CALIBRATE_FREQUENCY_MIN
+  #define SHAPER_CALIBRATE_FREQUENCY_MIN 5
+#endif
+#ifndef SHAPER_CALIBRATE_FREQUENCY_MAX
+  #define SHAPER_CALIBRATE_FREQUENCY_MAX 60
+#endif
+#ifndef SHAPER_CALIBRATE_FREQUENCY_STEP
+  #define SHAPER_CALIBRATE_FREQUENCY_STEP 1
+#endif
+#ifndef SHAPER_CALIBRATE_CYCLES
+  #define SHAPER_CALIBRATE_CYCLES 10
+#endif
+
+// Interval for checking the phases of homing (ms)
+#ifndef HOMING_CHECK_MS
+  #define HOMING_CHECK_MS 10
+#endif
+
+// Max. time for waiting on the scheduler's task to end the stepper (ms)
+#ifndef END_TIMEOUT_MS
+  #define END_TIMEOUT_MS 500
+#endif
+
+// Interval for passing the LED mode to the LED's scheduler
+#ifndef LED_SYNC_MS
+  #define LED_SYNC_MS 20
+#endif
+
 extern FastAccelStepperEngine engine;
 
 class Stepper {
@@ -64,7 +286,8 @@ class Stepper {
       ARRIVED, // only temporarily
       STOPPED, // only temporarily
       WARNING, // only temporarily
-      ERROR
+      ERROR,
+      CHARACTERIZING
     };
 
   private:
@@ -78,7 +301,8 @@ class Stepper {
       {MotorState::ARRIVED, "ARRIVED"},
       {MotorState::STOPPED, "STOPPED"},
       {MotorState::WARNING, "WARNING"},
-      {MotorState::ERROR, "ERROR"}};
+      {MotorState::ERROR, "ERROR"},
+      {MotorState::CHARACTERIZING, "CHARACTERIZING"}};
 
     // Map MotorState to LEDState
     std::map<MotorState, LED::LEDMode> MotorState_LEDMode_map = {
@@ -91,7 +315,123 @@ class Stepper {
       {MotorState::ARRIVED, LED::LEDMode::IDLE},
       {MotorState::STOPPED, LED::LEDMode::IDLE},
       {MotorState::WARNING, LED::LEDMode::IDLE},
-      {MotorState::ERROR, LED::LEDMode::ERROR}};
+      {MotorState::ERROR, LED::LEDMode::ERROR},
+      {MotorState::CHARACTERIZING, LED::LEDMode::DRIVING}};
+
+  public:
+    // home at the home switch, or sensorless at the hard stop (optionally measuring the stroke to the other end)
+    enum class HomingMode : uint8_t {
+      SWITCH,
+      STALLGUARD,
+      STALLGUARD_BOTH_ENDS
+    };
+
+  private:
+    std::map<HomingMode, std::string> HomingMode_string_map = {
+      {HomingMode::SWITCH, "SWITCH"},
+      {HomingMode::STALLGUARD, "STALLGUARD"},
+      {HomingMode::STALLGUARD_BOTH_ENDS, "STALLGUARD_BOTH_ENDS"}};
+
+  public:
+    // StealthChop and SpreadCycle by the tuned thresholds, or only one of them (for a single move)
+    enum class ChopperMode : uint8_t {
+      AUTO,
+      QUIET,
+      TORQUE
+    };
+
+  private:
+    std::map<ChopperMode, std::string> ChopperMode_string_map = {
+      {ChopperMode::AUTO, "AUTO"},
+      {ChopperMode::QUIET, "QUIET"},
+      {ChopperMode::TORQUE, "TORQUE"}};
+
+  public:
+    // what happens after a stall while moving (the position is lost in any case)
+    enum class StallPolicy : uint8_t {
+      OFF,    // not monitored
+      STOP,   // stop the move
+      REHOME, // stop and home again
+      RETRY   // stop, home again and retry a move (not a sequence or jogging)
+    };
+
+  private:
+    std::map<StallPolicy, std::string> StallPolicy_string_map = {
+      {StallPolicy::OFF, "OFF"},
+      {StallPolicy::STOP, "STOP"},
+      {StallPolicy::REHOME, "REHOME"},
+      {StallPolicy::RETRY, "RETRY"}};
+
+  public:
+    // derating steps by the temperature of the driver
+    enum class ThermalState : uint8_t {
+      NORMAL,
+      WARM,     // above 120°C (pre-warning)
+      HOT,      // above 143°C
+      CRITICAL, // above 150°C
+      SHUTDOWN  // switched off by the driver until cooled down
+    };
+
+  private:
+    std::map<ThermalState, std::string> ThermalState_string_map = {
+      {ThermalState::NORMAL, "NORMAL"},
+      {ThermalState::WARM, "WARM"},
+      {ThermalState::HOT, "HOT"},
+      {ThermalState::CRITICAL, "CRITICAL"},
+      {ThermalState::SHUTDOWN, "SHUTDOWN"}};
+
+    std::map<MotionPlanner::Shaper, std::string> Shaper_string_map = {
+      {MotionPlanner::Shaper::NONE, "NONE"},
+      {MotionPlanner::Shaper::ZV, "ZV"},
+      {MotionPlanner::Shaper::ZVD, "ZVD"},
+      {MotionPlanner::Shaper::EI, "EI"}};
+
+    enum class SwitchHoming {
+      NONE,
+      APPROACH,     // moving fast towards the switch
+      PRE_POSITION, // moving fast to just before the known home
+      BACK_OFF,     // moving away from the switch
+      CREEP         // moving slowly towards the switch
+    };
+
+    enum class StallHoming {
+      NONE,
+      HOME,    // moving towards the hard stop at home
+      FAR_END, // moving towards the hard stop at the other end
+      RETURN   // returning home (after backing off or measuring the stroke)
+    };
+
+    enum class Characterization {
+      NONE,
+      REFERENCE, // homing before the first test
+      TEST_OUT,  // moving away from home with the test values
+      TEST_BACK, // moving back with the test values
+      VERIFY     // re-approaching the switch for detecting lost steps
+    };
+
+    enum class CharacterizationMode {
+      LIMITS,    // highest speed and acceleration
+      CHOPPER,   // thresholds of StealthChop and CoolStep
+      RESONANCES // resonant cruise speeds
+    };
+
+    // load at cruise of a bin of the resonance map
+    struct ResonanceSample {
+        uint16_t stallGuardMean;
+        uint16_t stallGuardDeviation;
+        uint8_t pwmScaleSumMean;
+        bool stepLoss;
+    };
+
+    enum class MicrostepSwitch {
+      NONE,
+      MEASURE, // reading MSCNT at standstill
+      ALIGN,   // moving to the next full step
+      SWITCH,  // writing the coarse MRES
+      COARSE,  // moving with coarse µSteps
+      RESTORE, // writing the native MRES
+      FINISH   // moving the remainder with native µSteps
+    };
 
     enum class MotorDirection {
       FORWARDS,
@@ -115,7 +455,11 @@ class Stepper {
       _srStandstill.setWaiting();
 
       // Initialize FastAccelStepper here once
+#if defined(MOTION_TASK) && !CONFIG_FREERTOS_UNICORE
+      engine.init(MOTION_TASK_CORE);
+#else
       engine.init();
+#endif
       _stepper = engine.stepperConnectToPin(TMC_STEP);
       _stepper->setDirectionPin(TMC_DIR);
       _stepper->setEnablePin(TMC_EN);
@@ -123,35 +467,145 @@ class Stepper {
       _stepper->setDelayToEnable(50);
       _stepper->setDelayToDisable(1000);
     }
-    void begin(Scheduler* scheduler);
+    // the LED might be running on another scheduler (in another task)
+    void begin(Scheduler* scheduler, Scheduler* ledScheduler = nullptr);
+    // can be called from any task, waits for the scheduler's task to end everything
     void end();
-    typedef std::function<void(JsonDocument doc)> MotorEventCallback;
-    void listenMotorEvent(MotorEventCallback callback) { _motorEventCallback = callback; }
     DriverComState getComState() { return _driverComState; }
     std::string getComState_as_string() { return DriverComState_string_map[_driverComState]; }
     MotorState getMotorState() { return _motorState; }
     std::string getMotorState_as_string() { return MotorState_string_map[_motorState]; }
+    const char* getMotorState_as_string(MotorState state) { return MotorState_string_map[state].c_str(); }
     LED::LEDMode getMotorState_as_LEDMode() { return MotorState_LEDMode_map[_motorState]; }
-    void start_move(int32_t position, int32_t speed, int32_t acceleration, int32_t clientID = -1);
+    // jerk in mm/sss, moves with limited jerk are planned on the device
+    void start_move(int32_t position, int32_t speed, int32_t acceleration, int32_t jerk = 0, int32_t clientID = -1);
+    // waypoints with position, speed, acceleration in mm, mm/s, mm/ss
+    void start_sequence(const std::vector<MotorWaypoint>& waypoints, int32_t jerk = 0, int32_t clientID = -1);
+    // speed (signed) in mm/s, acceleration in mm/ss
+    void jog(int32_t speed, int32_t acceleration, int32_t clientID = -1);
     void halt_move();
     void do_homing();
-    int32_t getCurrentPosition() { return _stepper->getCurrentPosition() / STEPS_PER_MM; }
-    int32_t getCurrentSpeed() { return _stepper->getCurrentSpeedInMilliHz() / STEPS_PER_MM / 1000; }
+    // forget the stored PWM calibration and calibrate again
+    void calibrate();
+    // find the highest reliable speed and acceleration and enforce them as limits
+    void characterize();
+    // find the speeds for switching between StealthChop, CoolStep and SpreadCycle
+    void tuneChopper();
+    // sweep the cruise speed for the resonant bands which moves avoid
+    void mapResonances();
+    // oscillate the axis for finding the resonance of the input shaper
+    void calibrateShaper();
+    int32_t getCurrentPosition() { return _currentPosition() / STEPS_PER_MM; }
+    int32_t getCurrentSpeed() { return _currentSpeedInMilliHz() / STEPS_PER_MM / 1000; }
     int32_t getDestinationPosition() { return _destination_position; }
     int32_t getDestinationSpeed() { return _destination_speed; }
     int32_t getDestinationAcceleration() { return _destination_acceleration; }
+    int32_t getDestinationJerk() { return _destination_jerk; }
     bool getAutoHome() { return _autoHome; }
     void setAutoHome(bool autoHome);
+    uint32_t getJogTimeout() { return _jogTimeout; }
+    void setJogTimeout(uint32_t jogTimeout);
+    // deadbands in mm, mm/s
+    uint32_t getPositionDeadband() { return _positionDeadband; }
+    uint32_t getSpeedDeadband() { return _speedDeadband; }
+    void setTelemetryDeadband(uint32_t position, uint32_t speed);
+    // keep the motor enabled with holding current at standstill (needed for retaining the position)
+    bool getHoldPosition() { return _holdPosition; }
+    void setHoldPosition(bool holdPosition);
+    HomingMode getHomingMode() { return _homingMode; }
+    const char* getHomingMode_as_string(HomingMode mode) { return HomingMode_string_map[mode].c_str(); }
+    bool getHomingMode_from_string(const char* name, HomingMode* mode);
+    uint8_t getStallThreshold() { return _stallThreshold; }
+    void setHomingMode(HomingMode mode, uint8_t stallThreshold);
+    // stalls while moving are detected with the stall threshold of sensorless homing
+    StallPolicy getStallPolicy() { return _stallPolicy; }
+    const char* getStallPolicy_as_string(StallPolicy policy) { return StallPolicy_string_map[policy].c_str(); }
+    bool getStallPolicy_from_string(const char* name, StallPolicy* policy);
+    void setStallPolicy(StallPolicy policy);
+    // measured when homing at both ends or given (mm), 0 if unknown (the characterization moves along it)
+    int32_t getStrokeLength() { return _strokeLength; }
+    void setStrokeLength(int32_t strokeLength);
+    // limits of speed and acceleration (mm/s, mm/ss), 0 without a limit
+    int32_t getMaxSpeed() { return _maxSpeed; }
+    int32_t getMaxAcceleration() { return _maxAcceleration; }
+    void setLimits(int32_t maxSpeed, int32_t maxAcceleration);
+    bool getChopperMode_from_string(const char* name, ChopperMode* mode);
+    // TPWMTHRS, TCOOLTHRS (0 disables CoolStep)
+    uint32_t getStealthChopThreshold() { return _stealthChopThreshold; }
+    uint32_t getCoolStepThreshold() { return _coolStepThreshold; }
+    void setChopperThresholds(uint32_t stealthChopThreshold, uint32_t coolStepThreshold);
+    // CoolStep window (SEMIN 1..15, 0 disables CoolStep, SEMAX 0..15)
+    uint8_t getCoolStepMin() { return _coolStepMin; }
+    uint8_t getCoolStepMax() { return _coolStepMax; }
+    void setCoolStepWindow(uint8_t min, uint8_t max);
+    // current while accelerating, at cruise and at standstill (% of TMC_RMS_CURRENT)
+    uint8_t getCurrentAcceleration() { return _currentAcceleration; }
+    uint8_t getCurrentCruise() { return _currentCruise; }
+    uint8_t getCurrentHold() { return _currentHold; }
+    void setCurrentSchedule(uint8_t acceleration, uint8_t cruise, uint8_t hold);
+    // derating of current and acceleration (%), the speed is lowered by half of it
+    ThermalState getThermalState() { return _thermalState; }
+    const char* getThermalState_as_string(ThermalState state) { return ThermalState_string_map[state].c_str(); }
+    uint8_t getThermalDerating() { return _thermalDerating; }
+    MotorEvent thermalEvent();
+    // bit n is set when n * RESONANCE_SPEED_STEP mm/s is resonant, 0 when not mapped
+    uint64_t getResonanceMap() { return _resonanceMap; }
+    void setResonanceMap(uint64_t resonanceMap);
+    // shaping of the moves from standstill (Hz, damping ratio)
+    MotionPlanner::Shaper getShaper() { return _shaper; }
+    const char* getShaper_as_string(MotionPlanner::Shaper shaper) { return Shaper_string_map[shaper].c_str(); }
+    bool getShaper_from_string(const char* name, MotionPlanner::Shaper* shaper);
+    float getShaperFrequency() { return _shaperFrequency; }
+    float getShaperDamping() { return _shaperDamping; }
+    void setShaper(MotionPlanner::Shaper shaper, float frequency, float damping);
     std::string getHomingState_as_string();
+    size_t getCommandQueueDepth() { return _commandQueue.depth(); }
+    uint32_t getCommandsDropped() { return _commandQueue.getDropped(); }
+    // worst case of hitting the home switch, until stopped and until handled by the scheduler (µs)
+    uint32_t getHomeStopLatencyMax() { return _homeStopLatencyMax; }
+    uint32_t getHomeTaskLatencyMax() { return _homeTaskLatencyMax; }
+    // steps done after the switch was hit (µSteps)
+    // snapshot of the current config
+    MotorEvent configEvent();
 
   private:
     Scheduler* _scheduler = nullptr;
-    TMC2209 _stepper_driver;
+    Scheduler* _ledScheduler = nullptr;
+    // task running the scheduler (seen by the command task), ending is handed over to it
+    TaskHandle_t _schedulerTask = nullptr;
+    std::atomic<bool> _endRequested{false};
+    void _end();
+    std::atomic<LED::LEDMode> _ledMode{LED::LEDMode::INITIALIZING};
+    Task* _ledSyncTask = nullptr;
+    LED::LEDMode _ledModeSynced = LED::LEDMode::NONE;
+    void _setLEDMode(LED::LEDMode mode);
+    void _syncLEDMode();
+    TMC2209Driver _stepper_driver;
     FastAccelStepper* _stepper = nullptr;
     DriverComState _driverComState = DriverComState::UNKNOWN;
     MotorState _motorState = MotorState::UNKNOWN;
     StatusRequest _srHome;
+    // moving towards home, the switch stops the movement right in the ISR (dropping the queued commands) and latches
+    // the step count, evaluated by the homing-IRQ-task once the stepper stopped (latencies in µs from entering the ISR)
+    struct HomeLatch {
+        int32_t position;
+        int64_t time;         // esp_timer
+        uint32_t stopLatency; // until the ISR stopped the stepper
+        uint32_t taskLatency; // until the task ran first
+    };
+    volatile bool _homeLatched = false;
+    HomeLatch _homeLatch = {};
+    uint32_t _homeStopLatencyMax = 0;
+    uint32_t _homeTaskLatencyMax = 0;
     void IRAM_ATTR _isrHome() {
+      if (_movementDirection == MotorDirection::BACKWARDS && !_homeLatched) {
+        _homeLatch.time = esp_timer_get_time();
+        _homeLatch.position = _stepper->getCurrentPosition();
+        _stepper->forceStopAndNewPosition(_homeLatch.position);
+        _homeLatch.stopLatency = esp_timer_get_time() - _homeLatch.time;
+        _homeLatch.taskLatency = 0;
+        _homeLatched = true;
+      }
       if (_srHome.pending())
         _srHome.signalComplete();
     }
@@ -162,34 +616,252 @@ class Stepper {
     }
     Task* _homingIRQTask = nullptr;
     void _homingIRQCallback();
+    void _trackHomeLatency();
     Task* _diagIRQTask = nullptr;
     void _diagIRQCallback();
+    void _diagnoseTMC2209();
     StatusRequest _srHoming;
     Task* _homingTask = nullptr;
     Task* _checkTMC2209Task = nullptr;
+    // the driver's registers are read asynchronously, the second part runs when they arrived
     void _checkTMC2209();
+    void _checkTMC2209Status();
     void _initTMC2209();
+    void _initTMC2209Communication();
     void _initTMC2209Gradient(bool startAdaptation = false);
     void _checkTMC2209Gradient();
+    void _checkTMC2209GradientResult();
     void _initTMC2209Finished();
-    void _reInitTMC2209();
+    void _initTMC2209Check();
+    void _reInitTMC2209(bool powerOnHoming = false);
+    void _reInitTMC2209Check(bool powerOnHoming);
     uint8_t _pwmGradient = 0;
     uint8_t _pwmOffset = 0;
+    // PWM calibration is stored (together with a hash of the driver config)
+    bool _pwmCalibrated = false;
+    uint32_t _pwmConfigHash();
+    void _savePwmCalibration();
+    // persistent settings are written behind, postponed while moving (the NVS write blocks the scheduler)
+    ConfigStore _configStore;
     InitializationState _initializationState = InitializationState::UNITITIALIZED;
     bool _homed = false;
     bool _autoHome = false;
+    bool _holdPosition = false;
+    void _applyStandstillMode();
+    // the chopper mode is selected per move (from standstill) and back to auto when stopped
+    ChopperMode _chopperMode = ChopperMode::AUTO;
+    // a halted move might still decelerate when stopped, auto is restored by the telemetry then
+    bool _chopperModeRestore = false;
+    uint32_t _stealthChopThreshold = STEALTHCHOP_THRSH;
+    uint32_t _coolStepThreshold = COOLSTEP_THRSH;
+    uint8_t _coolStepMin = COOLSTEP_SEMIN;
+    uint8_t _coolStepMax = COOLSTEP_SEMAX;
+    // IRUN is boosted while the speed changes (and at standstill for the next start), reduced at cruise
+    uint8_t _currentAcceleration = CURRENT_ACCELERATION_PERCENT;
+    uint8_t _currentCruise = CURRENT_CRUISE_PERCENT;
+    uint8_t _currentHold = CURRENT_HOLD_PERCENT;
+    uint8_t _runCurrentBoost = 31;
+    uint8_t _runCurrentCruise = 31;
+    bool _cruiseCurrent = false;
+    void _applyCurrentSchedule();
+    void _scheduleCurrent(bool cruise);
+    static uint8_t _scaleCurrent(uint8_t currentScale, uint32_t percent) { return constrain(static_cast<int32_t>((currentScale + 1) * percent / 100) - 1, 0, 31); }
+    // raised right away, lowered after the flags stayed clear for a while (they toggle at the thresholds)
+    ThermalState _thermalState = ThermalState::NORMAL;
+    uint8_t _thermalDerating = 100;
+    uint32_t _thermalCooling = 0; // ms, since being below the current state
+    void _checkThermal();
+    void _applyThermalCaps();
+    void _applyChopperMode();
+    void _selectChopperMode(ChopperMode mode);
+    static uint32_t _speedToTstep(int32_t speed);
+    // homing at the switch, fast first and slowly for the position
+    SwitchHoming _switchHoming = SwitchHoming::NONE;
+    uint8_t _homingBackOffs = 0;
+    // where the switch was found compared to the known home (µSteps)
+    int32_t _homeDeviation = 0;
+    void _startSwitchHoming();
+    void _startBackOff();
+    void _startCreep();
+    // sensorless homing, the stall is signalled via DIAG (StealthChop only)
+    HomingMode _homingMode = HomingMode::SWITCH;
+    uint8_t _stallThreshold = STALL_HOMING_THRESHOLD;
+    int32_t _strokeLength = 0;
+    StallHoming _stallHoming = StallHoming::NONE;
+    Task* _homingCheckTask = nullptr;
+    void _startStallHoming();
+    void _homingCheckCallback();
+    void _stallDetected();
+    void _endStallHoming();
+    void _finishStallHoming();
+    // stall monitoring while driving, the recovery homes first and retries the move
+    enum class StallRecovery {
+      NONE,
+      STOPPING,
+      HOMING
+    };
+    StallPolicy _stallPolicy = StallPolicy::STOP;
+    StallRecovery _stallRecovery = StallRecovery::NONE;
+    uint8_t _stallSamples = 0;
+    bool _stallSampling = false;
+    struct {
+        bool valid;
+        uint8_t count;
+        int32_t position;
+        int32_t speed;
+        int32_t acceleration;
+        int32_t jerk;
+    } _stallRetry = {};
+    Task* _stallMonitorTask = nullptr;
+    void _stallMonitorCallback();
+    void _checkStall();
+    void _stallWhileMoving();
+    // moves are limited to the characterized capability of the machine
+    int32_t _maxSpeed = 0;
+    int32_t _maxAcceleration = 0;
+    int32_t _speedCap();
+    int32_t _accelerationCap();
+    int32_t _limitSpeed(int32_t speed);
+    int32_t _limitAcceleration(int32_t acceleration);
+    // cruise speeds are lowered out of resonant bins, the ones below are passed at the highest acceleration
+    uint64_t _resonanceMap = 0;
+    static uint8_t _resonanceBin(int32_t speed) { return min((speed + RESONANCE_SPEED_STEP / 2) / RESONANCE_SPEED_STEP, static_cast<int32_t>(RESONANCE_BINS - 1)); }
+    int32_t _passResonances(int32_t speed, int32_t acceleration);
+    // speeds are increased first (at the lowest acceleration), then the acceleration (at the highest speed)
+    struct {
+        Characterization phase;
+        bool accelerationSweep;
+        int32_t speed;
+        int32_t acceleration;
+        int32_t distance;
+        int32_t bestSpeed;
+        int32_t bestAcceleration;
+        uint16_t minStallGuard;
+        uint8_t maxPwmScaleSum;
+        bool sampling;
+        bool switchHit;
+        // tuning the chopper thresholds or mapping the resonances instead (sampled at cruise)
+        CharacterizationMode mode;
+        uint32_t stallGuardSum;
+        uint32_t stallGuardSquareSum;
+        uint32_t pwmScaleSumSum;
+        uint16_t stallGuardSamples;
+        int32_t stealthChopSpeed;
+        int32_t coolStepSpeed;
+        uint16_t coolStepStallGuard; // mean at the CoolStep speed
+        std::vector<ResonanceSample> resonances; // per bin, from the first one
+    } _characterization = {};
+    Task* _characterizeTask = nullptr;
+    void _startCharacterization(CharacterizationMode mode);
+    // warns why the test moves of a mode can't be started
+    bool _canTestAlongStroke(CharacterizationMode mode);
+    void _characterizeCallback();
+    void _characterizeSample();
+    void _characterizeTestMove(int32_t speed, int32_t acceleration);
+    void _characterizeEvaluate();
+    void _characterizeNext(bool passed);
+    void _chopperTuneNext(bool passed);
+    void _resonanceNext(bool stepLoss);
+    uint64_t _resonanceEvaluate();
+    void _characterizeEnd();
+    void _characterizeFinish(const char* warning);
+    // shaped moves are planned (without jerk as well), the calibration samples the load per frequency
+    MotionPlanner::Shaper _shaper = MotionPlanner::Shaper::NONE;
+    float _shaperFrequency = SHAPER_DEFAULT_FREQUENCY;
+    float _shaperDamping = SHAPER_DEFAULT_DAMPING;
+    struct {
+        bool active;
+        int32_t position; // µSteps, the oscillation starts and ends there
+        int32_t frequency;
+        uint32_t stallGuardSum;
+        uint16_t stallGuardSamples;
+        bool sampling;
+        std::vector<uint16_t> response; // mean SG_RESULT per frequency
+    } _shaperCalibration = {};
+    Task* _shaperCalibrateTask = nullptr;
+    void _shaperCalibrateCallback();
+    void _shaperTestMove();
+    void _shaperCalibrateEnd();
+    void _shaperCalibrateFinish(const char* warning);
+    // the position is recorded at standstill and invalidated when starting to move
+    static uint32_t _positionRecordCRC(const PositionRecord& record);
+    void _recordPosition();
+    void _invalidatePosition();
+    void _restorePosition();
+    // FastAccelStepper counts steps of the current MRES, the position is kept in µSteps of USTEPS_PER_STEP
+    // (USTEPS_FAST must be a power of two below USTEPS_PER_STEP)
+    uint16_t _microsteps = USTEPS_PER_STEP;
+    int32_t _microstepOffset = 0; // µSteps at step 0
+    MicrostepSwitch _microstepSwitch = MicrostepSwitch::NONE;
+    bool _microstepHalted = false;
+    // MSCNT per µStep (+1/-1 by the direction of the driver), 0 while unknown
+    int8_t _mscntDirection = 0;
+    uint8_t _microstepAlignments = 0;
+    int32_t _alignedPosition = 0;
+    uint16_t _alignedMscnt = 0;
+    int32_t _toMicrosteps(int32_t steps) { return steps * (USTEPS_PER_STEP / _microsteps) + _microstepOffset; }
+    int32_t _currentPosition() { return _toMicrosteps(_stepper->getCurrentPosition()); }
+    int32_t _currentSpeedInMilliHz() { return _stepper->getCurrentSpeedInMilliHz() * (USTEPS_PER_STEP / _microsteps); }
+    int32_t _stepsPerMm() { return STEPS_PER_MM * _microsteps / USTEPS_PER_STEP; }
+    int32_t _destinationSteps();
+    void _setMicrosteps(uint16_t microsteps, int32_t position);
+    void _microstepMeasure();
+    void _microstepAlign(bool measured);
+    void _microstepStart();
+    void _microstepRestore();
+    void _microstepFinish();
+    bool _microstepArrived();
     // position, speed, acceleration in mm, mm/s, mm/ss
     // (current values will be gathered from FastAccelStepper on demand)
     int32_t _destination_position = 0;
     int32_t _destination_speed = 0;
     int32_t _destination_acceleration = 0;
-    MotorDirection _movementDirection = MotorDirection::STANDSTILL;
+    int32_t _destination_jerk = 0;
+    // as commanded (the destination's values are derated from them)
+    int32_t _requested_speed = 0;
+    int32_t _requested_acceleration = 0;
+    // (read by the home switch's ISR)
+    volatile MotorDirection _movementDirection = MotorDirection::STANDSTILL;
+    // telemetry is sent on change only, at a rate following the motion
     Task* _checkMovementTask = nullptr;
+    uint32_t _positionDeadband = TELEMETRY_POSITION_DEADBAND;
+    uint32_t _speedDeadband = TELEMETRY_SPEED_DEADBAND;
+    int32_t _telemetryPosition = 0;
+    int32_t _telemetrySpeed = 0;
+    int32_t _sampledSpeed = 0;
+    uint8_t _telemetryRampState = RAMP_STATE_IDLE;
+    uint8_t _telemetryCurrentScale = 0;
+    bool _currentSampling = false;
+    bool _telemetryForced = false;
+    void _forceTelemetry();
+    void _monitorMovement();
     void _checkMovementCallback();
+    // arrival is detected by watching FastAccelStepper coming to a halt
+    Task* _checkArrivalTask = nullptr;
+    void _checkArrivalCallback();
     void _checkStandstillCallback();
     StatusRequest _srStandstill;
+    // multi-waypoint and jerk limited moves are fed directly into FastAccelStepper's queue
+    MotionPlanner _planner;
+    bool _plannedMove = false;
+    bool _startPlanner(const std::vector<MotionPlanner::Waypoint>& path, uint32_t jerk);
+    Task* _feedQueueTask = nullptr;
+    void _feedQueueCallback();
+    // jogging stops when no jog command is received within the timeout (ms)
+    bool _jogging = false;
+    uint32_t _jogTimeout = JOG_TIMEOUT_MS;
+    Task* _jogWatchdogTask = nullptr;
+    void _jogWatchdogCallback();
     // to be called by website for motor specific events
-    void _webEventCallback(JsonDocument doc);
-    // to be called by stepper for motor specific events
-    MotorEventCallback _motorEventCallback = nullptr;
+    void _webEventCallback(const MotorCommand& command);
+    // commands are queued by the website and handled by the scheduler
+    SPSCQueue<MotorCommand, COMMAND_QUEUE_CAPACITY> _commandQueue;
+    // stopping is passed out-of-band (handled first, cancelling the movements still queued)
+    std::atomic<bool> _stopRequested{false};
+    uint32_t _commandsDropped = 0;
+    Task* _commandTask = nullptr;
+    void _commandCallback();
+    void _handleCommand(const MotorCommand& command);
+    // motor specific events are published to the event bus
+    MotorEvent _motorStateEvent(MotorState state);
 };
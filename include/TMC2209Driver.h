@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <TaskSchedulerDeclarations.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+
+// Timeout for a read reply (ms) and number of attempts per register
+#ifndef DRIVER_REPLY_TIMEOUT_MS
+  #define DRIVER_REPLY_TIMEOUT_MS 5
+#endif
+#ifndef DRIVER_READ_RETRIES
+  #define DRIVER_READ_RETRIES 2
+#endif
+
+// TMC2209 on its single-wire UART with the registers mirrored in RAM
+// - the setters only change the shadow registers, flush() writes the changed ones
+// - refresh() reads the status registers in one batch, the getters return that snapshot
+// Reads and writes are queued and handled by a task woken up by the UART's RX events,
+// the scheduler never waits for the driver (completion is signalled by callbacks)
+class TMC2209Driver {
+  public:
+    // called on the scheduler when a batch of transactions is done (ok is false if a read failed)
+    using Callback = std::function<void(bool ok)>;
+
+    enum SerialAddress : uint8_t {
+      SERIAL_ADDRESS_0 = 0,
+      SERIAL_ADDRESS_1,
+      SERIAL_ADDRESS_2,
+      SERIAL_ADDRESS_3
+    };
+
+    enum StandstillMode : uint8_t {
+      NORMAL = 0,
+      FREEWHEELING,
+      STRONG_BRAKING,
+      BRAKING
+    };
+
+    // GSTAT
+    struct GlobalStatus {
+        uint32_t reset : 1;
+        uint32_t drv_err : 1;
+        uint32_t uv_cp : 1;
+        uint32_t reserved : 29;
+    };
+
+    // DRV_STATUS
+    struct Status {
+        uint32_t over_temperature_warning : 1;
+        uint32_t over_temperature_shutdown : 1;
+        uint32_t short_to_ground_a : 1;
+        uint32_t short_to_ground_b : 1;
+        uint32_t low_side_short_a : 1;
+        uint32_t low_side_short_b : 1;
+        uint32_t open_load_a : 1;
+        uint32_t open_load_b : 1;
+        uint32_t over_temperature_120c : 1;
+        uint32_t over_temperature_143c : 1;
+        uint32_t over_temperature_150c : 1;
+        uint32_t over_temperature_157c : 1;
+        uint32_t reserved0 : 4;
+        uint32_t current_scaling : 5;
+        uint32_t reserved1 : 9;
+        uint32_t stealth_chop_mode : 1;
+        uint32_t standstill : 1;
+    };
+
+    // groups of status registers for refresh()
+    enum Refresh : uint8_t {
+      REFRESH_COMMUNICATION = 0x01, // IOIN, GCONF
+      REFRESH_GLOBAL_STATUS = 0x02, // GSTAT
+      REFRESH_DRIVER_STATUS = 0x04, // DRV_STATUS
+      REFRESH_PWM = 0x08,           // PWM_SCALE, PWM_AUTO
+      REFRESH_LOAD = 0x10,          // SG_RESULT, TSTEP
+      REFRESH_MICROSTEPS = 0x20,    // MSCNT
+      REFRESH_ALL = 0x3F
+    };
+
+    struct Snapshot {
+        uint32_t timestamp; // ms
+        bool communicating;
+        bool setup; // GCONF.pdn_disable is lost on a reset of the driver
+        GlobalStatus globalStatus;
+        Status status;
+        uint8_t pwmScaleSum;
+        int16_t pwmScaleAuto;
+        uint8_t pwmOffsetAuto;
+        uint8_t pwmGradientAuto;
+        uint16_t stallGuardResult;
+        uint32_t interstepDuration; // TSTEP
+        uint16_t microstepCounter;  // MSCNT
+    };
+
+    void begin(Scheduler* scheduler);
+    // pending writes are sent right away, anything else is dropped
+    void end();
+    // start the UART, the shadow registers are reset to defaults (written on the next flush)
+    void setup(HardwareSerial& serial, uint32_t baud, SerialAddress address, int16_t rx, int16_t tx);
+    // queue writing the changed registers
+    void flush(Callback done = nullptr);
+    // write all registers on the next flush (e.g. after a reset of the driver)
+    void invalidate() { _dirty = (1 << SHADOW_COUNT) - 1; }
+    // queue reading the status registers, the snapshot is updated when done
+    void refresh(uint8_t registers = REFRESH_ALL, Callback done = nullptr);
+    const Snapshot& getSnapshot() const { return _snapshot; }
+    uint32_t getReadErrors() const { return _readErrors; }
+    size_t getPendingTransactions() const { return _transactions.size(); }
+
+    // from the snapshot
+    bool isCommunicating() const { return _snapshot.communicating; }
+    bool isSetupAndCommunicating() const { return _snapshot.communicating && _snapshot.setup; }
+    bool isCommunicatingButNotSetup() const { return _snapshot.communicating && !_snapshot.setup; }
+    GlobalStatus getGlobalStatus() const { return _snapshot.globalStatus; }
+    Status getStatus() const { return _snapshot.status; }
+    uint8_t getPwmScaleSum() const { return _snapshot.pwmScaleSum; }
+    int16_t getPwmScaleAuto() const { return _snapshot.pwmScaleAuto; }
+    uint8_t getPwmOffsetAuto() const { return _snapshot.pwmOffsetAuto; }
+    uint8_t getPwmGradientAuto() const { return _snapshot.pwmGradientAuto; }
+    uint16_t getStallGuardResult() const { return _snapshot.stallGuardResult; }
+    uint32_t getInterstepDuration() const { return _snapshot.interstepDuration; }
+    uint16_t getMicrostepCounter() const { return _snapshot.microstepCounter; }
+
+    // queued right away (GSTAT is write-1-to-clear)
+    void clearReset();
+
+    // shadow registers
+    void enable();
+    void disable();
+    void setMicrostepsPerStep(uint16_t microstepsPerStep);
+    void enableInverseMotorDirection() { _setBits(GCONF, 1, 3, 1); }
+    void disableInverseMotorDirection() { _setBits(GCONF, 1, 3, 0); }
+    void useExternalSenseResistors() { _setBits(GCONF, 1, 1, 0); }
+    void useInternalSenseResistors() { _setBits(GCONF, 1, 1, 1); }
+    void setRMSCurrent(uint16_t mA, float rSense, float holdMultiplier = 0.5f);
+    // current scale (0..31) within the sense range chosen by setRMSCurrent()
+    uint8_t getRunCurrent() const { return (_shadow[IHOLD_IRUN] >> 8) & 0x1F; }
+    void setRunCurrent(uint8_t irun) { _setBits(IHOLD_IRUN, 0x1F, 8, irun); }
+    void enableStealthChop() { _setBits(GCONF, 1, 2, 0); }
+    void disableStealthChop() { _setBits(GCONF, 1, 2, 1); }
+    void setStealthChopDurationThreshold(uint32_t threshold) { _setBits(TPWMTHRS, 0xFFFFF, 0, threshold); }
+    void setCoolStepDurationThreshold(uint32_t threshold) { _setBits(TCOOLTHRS, 0xFFFFF, 0, threshold); }
+    // minimum and maximum of the StallGuard result window (SEMIN, SEMAX)
+    void enableCoolStep(uint8_t lowerThreshold = 1, uint8_t upperThreshold = 0);
+    void disableCoolStep() { _setBits(COOLCONF, 0xF, 0, 0); }
+    void setStandstillMode(StandstillMode mode) { _setBits(PWMCONF, 0x3, 20, mode); }
+    void setStallGuardThreshold(uint8_t threshold) { _setBits(SGTHRS, 0xFF, 0, threshold); }
+    void setPwmOffset(uint8_t offset) { _setBits(PWMCONF, 0xFF, 0, offset); }
+    void setPwmGradient(uint8_t gradient) { _setBits(PWMCONF, 0xFF, 8, gradient); }
+    void enableAutomaticCurrentScaling() { _setBits(PWMCONF, 1, 18, 1); }
+    void disableAutomaticCurrentScaling() { _setBits(PWMCONF, 1, 18, 0); }
+    void enableAutomaticGradientAdaptation() { _setBits(PWMCONF, 1, 19, 1); }
+    void disableAutomaticGradientAdaptation() { _setBits(PWMCONF, 1, 19, 0); }
+
+  private:
+    // registers which are mirrored (write-only or configuration)
+    enum Shadow : uint8_t {
+      GCONF,
+      IHOLD_IRUN,
+      TPOWERDOWN,
+      TPWMTHRS,
+      TCOOLTHRS,
+      SGTHRS,
+      COOLCONF,
+      CHOPCONF,
+      PWMCONF,
+      SHADOW_COUNT
+    };
+    static const uint8_t SHADOW_ADDRESS[SHADOW_COUNT];
+    static const uint32_t SHADOW_DEFAULT[SHADOW_COUNT];
+
+    HardwareSerial* _serial = nullptr;
+    uint8_t _address = SERIAL_ADDRESS_0;
+    uint32_t _shadow[SHADOW_COUNT] = {};
+    uint16_t _dirty = 0;
+    // off-time while enabled, 0 disables the driver
+    uint8_t _toff = 3;
+    Snapshot _snapshot = {};
+    uint32_t _readErrors = 0;
+    void _setBits(Shadow reg, uint32_t mask, uint8_t shift, uint32_t value);
+
+    // transactions of a batch share its result, the last one completes it
+    struct Batch {
+        bool ok;
+        Callback done;
+    };
+    enum class TransactionType : uint8_t {
+      READ,
+      WRITE,
+      COMPLETE
+    };
+    struct Transaction {
+        TransactionType type;
+        uint8_t address;
+        uint32_t value;
+        std::shared_ptr<Batch> batch;
+    };
+    std::deque<Transaction> _transactions;
+    void _enqueue(TransactionType type, uint8_t address, uint32_t value, const std::shared_ptr<Batch>& batch);
+
+    Scheduler* _scheduler = nullptr;
+    StatusRequest _srReceive;
+    void IRAM_ATTR _isrReceive() {
+      if (_srReceive.pending())
+        _srReceive.signalComplete();
+    }
+    Task* _transactionTask = nullptr;
+    void _transactionCallback();
+    Task* _timeoutTask = nullptr;
+    // state of the read in progress
+    bool _waiting = false;
+    uint8_t _attempt = 0;
+    uint32_t _sentAt = 0;
+    uint8_t _reply[8] = {};
+    size_t _received = 0;
+
+    static uint8_t _crc(const uint8_t* datagram, size_t length);
+    void _sendWrite(uint8_t address, uint32_t value);
+    void _sendRead(uint8_t address);
+    bool _receiveReply(uint8_t address, uint32_t* value);
+    void _store(uint8_t address, uint32_t value);
+};
@@ -5,16 +5,24 @@
 #pragma once
 
 #include <ESPAsyncWebServer.h>
+#include <EventBus.h>
+#include <MotorCommand.h>
 #include <TaskSchedulerDeclarations.h>
 
+#include <mutex>
 #include <string>
 
+#ifndef WSL_MAX_WS_CLIENTS
+  #define WSL_MAX_WS_CLIENTS DEFAULT_MAX_WS_CLIENTS
+#endif
+
 class WebSite {
   public:
     explicit WebSite(AsyncWebServer& webServer) : _webServer(&webServer) { _sr.setWaiting(); }
     void begin(Scheduler* scheduler);
     void end();
-    typedef std::function<void(JsonDocument doc)> WebEventCallback;
+    // called from the AsyncTCP task
+    typedef std::function<void(const MotorCommand& command)> WebEventCallback;
     void listenWebEvent(WebEventCallback callback) { _webEventCallback = callback; }
     StatusRequest* getStatusRequest() { return &_sr; }
 
@@ -26,9 +34,25 @@ class WebSite {
     StatusRequest _sr;
     AsyncWebServer* _webServer;
     AsyncWebSocket* _ws = nullptr;
+    // connected clients and whether they opted in for binary frames (changed by AsyncTCP, read by the event bus)
+    struct ClientSlot {
+        uint32_t id; // 0 when free
+        bool binary;
+    };
+    ClientSlot _clients[WSL_MAX_WS_CLIENTS] = {};
+    std::mutex _clientsMutex;
+    bool _addClient(uint32_t clientID);
+    void _removeClient(uint32_t clientID);
+    void _setBinaryClient(uint32_t clientID, bool binary);
     uint32_t _disconnectTime;
     // to be called by website for motor specific events
     WebEventCallback _webEventCallback = nullptr;
-    // to be called by stepper for motor specific events
-    void _motorEventCallback(JsonDocument doc);
+    // to be called by the event bus for motor specific events
+    void _motorEventCallback(const MotorEvent& event);
+    void _toJson(const MotorEvent& event, JsonDocument* doc);
+    void _fromJson(const JsonDocument& doc, int32_t clientID, MotorCommand* command);
+    // state of the motor after a MOTOR_STATE event (as Stepper::MotorState)
+    static uint8_t _persistentState(const MotorEvent& event);
+    // resonant speeds (mm/s) of the resonance map
+    static void _resonancesToJson(uint64_t resonanceMap, JsonArray resonances);
 };
@@ -6,21 +6,24 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include <ConfigStore.h>
 #include <ESPAsyncWebServer.h>
 #include <ESPNetworkTask.h>
+#include <EventBus.h>
 #include <EventHandler.h>
 #include <LED.h>
 #include <LittleFS.h>
 #include <MycilaESPConnect.h>
 #include <MycilaSystem.h>
 #include <Stepper.h>
-#include <TMC2209.h>
+#include <TMC2209Driver.h>
 #include <WebServerAPI.h>
 #include <WebSite.h>
 
 // in main.cpp
 extern ESPNetwork espNetwork;
 extern EventHandler eventHandler;
+extern EventBus eventBus;
 extern WebServerAPI webServerAPI;
 extern WebSite webSite;
 extern LED led;
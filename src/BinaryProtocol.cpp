@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+
+#include <BinaryProtocol.h>
+#include <string.h>
+
+uint8_t* BinaryProtocol::_putInt32(uint8_t* frame, int32_t value) {
+  uint32_t raw = static_cast<uint32_t>(value);
+  frame[0] = raw;
+  frame[1] = raw >> 8;
+  frame[2] = raw >> 16;
+  frame[3] = raw >> 24;
+  return frame + 4;
+}
+
+int32_t BinaryProtocol::_getInt32(const uint8_t* frame) {
+  return static_cast<int32_t>(frame[0] | (frame[1] << 8) | (frame[2] << 16) | (static_cast<uint32_t>(frame[3]) << 24));
+}
+
+size_t BinaryProtocol::encodeEvent(const MotorEvent& event, uint8_t* frame) {
+  uint8_t* end = frame;
+  switch (event.type) {
+    case MotorEvent::Type::MOVE_STATE:
+      *end++ = MOVE_STATE;
+      end = _putInt32(end, event.moveState.position);
+      end = _putInt32(end, event.moveState.speed);
+      *end++ = event.moveState.currentScale;
+      return end - frame;
+
+    case MotorEvent::Type::MOTOR_STATE:
+      // only plain state changes, anything carrying more stays JSON
+      if (event.warning != nullptr || event.error != nullptr || (event.parts & (MotorEvent::JOG | MotorEvent::WAYPOINTS)))
+        return 0;
+      *end++ = MOTOR_STATE;
+      *end++ = event.state;
+      *end++ = ((event.parts & MotorEvent::MOVE_STATE) ? HAS_MOVE_STATE : 0) | ((event.parts & MotorEvent::DESTINATION) ? HAS_DESTINATION : 0);
+      end = _putInt32(end, (event.parts & MotorEvent::ORIGIN) ? event.origin : -1);
+      end = _putInt32(end, event.moveState.position);
+      end = _putInt32(end, event.moveState.speed);
+      end = _putInt32(end, event.destination.position);
+      end = _putInt32(end, event.destination.speed);
+      end = _putInt32(end, event.destination.acceleration);
+      end = _putInt32(end, event.destination.jerk);
+      return end - frame;
+
+    default:
+      return 0;
+  }
+}
+
+bool BinaryProtocol::decodeCommand(const uint8_t* frame, size_t length, int32_t clientID, MotorCommand* command) {
+  if (length == 0)
+    return false;
+
+  *command = {};
+  command->origin = clientID;
+  switch (frame[0]) {
+    case MOVE:
+      if (length != 1 + 4 * 4)
+        return false;
+      command->type = MotorCommand::Type::MOVE;
+      command->options = MotorCommand::SPEED | MotorCommand::ACCELERATION;
+      command->position = _getInt32(frame + 1);
+      command->speed = _getInt32(frame + 5);
+      command->acceleration = _getInt32(frame + 9);
+      command->jerk = _getInt32(frame + 13);
+      return true;
+    case STOP:
+      command->type = MotorCommand::Type::STOP;
+      return length == 1;
+    case HOME:
+      command->type = MotorCommand::Type::HOME;
+      return length == 1;
+    case JOG:
+      if (length != 1 + 2 * 4)
+        return false;
+      command->type = MotorCommand::Type::JOG;
+      command->options = MotorCommand::SPEED;
+      command->speed = _getInt32(frame + 1);
+      command->acceleration = _getInt32(frame + 5);
+      if (command->acceleration > 0)
+        command->options |= MotorCommand::ACCELERATION;
+      return true;
+    default:
+      return false;
+  }
+}
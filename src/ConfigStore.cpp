@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+
+#include <Preferences.h>
+#include <thingy.h>
+
+#define TAG "ConfigStore"
+
+void ConfigStore::begin(Scheduler* scheduler, BusyCallback busy) {
+  // Task handling
+  _scheduler = scheduler;
+  _busy = busy;
+
+  // read everything at once
+  LOGD(TAG, "Get persistent options from preferences...");
+  Preferences preferences;
+  preferences.begin("tdrive", true);
+  // the fields of an older blob are copied over the defaults (not its padding, newer fields might be placed there)
+  _config = _defaults();
+  Config stored = {};
+  size_t length = preferences.getBytesLength("config");
+  bool valid = length >= sizeof(stored.version) && length <= sizeof(stored) && preferences.getBytes("config", &stored, length) == length && stored.version >= 1 &&
+               stored.version <= Config::VERSION && length >= _payloadSize(stored.version);
+  if (valid)
+    memcpy(&_config, &stored, _payloadSize(stored.version));
+  _journal = {};
+  if (preferences.getBytesLength("posrec") == sizeof(_journal))
+    preferences.getBytes("posrec", &_journal, sizeof(_journal));
+  preferences.end();
+
+  // create a (stopped) task for writing behind
+  _flushTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _flushBehind(); }, _scheduler, false);
+
+  if (!valid) {
+    _migrate();
+  } else if (_config.version != Config::VERSION) {
+    LOGI(TAG, "Upgrading config from version %d to %d", _config.version, Config::VERSION);
+    _config.version = Config::VERSION;
+    edit();
+  }
+}
+
+// the fields of a version end where the ones of the next version start
+size_t ConfigStore::_payloadSize(uint16_t version) {
+  switch (version) {
+    case 1:
+      return offsetof(Config, homingMode);
+    case 2:
+      return offsetof(Config, maxSpeed);
+    case 3:
+      return offsetof(Config, stealthChopThreshold);
+    case 4:
+      return offsetof(Config, shaper);
+    case 5:
+      return offsetof(Config, resonanceMap);
+    case 6:
+      return offsetof(Config, coolStepMin);
+    case 7:
+      return offsetof(Config, stallPolicy);
+    default:
+      return sizeof(Config);
+  }
+}
+
+void ConfigStore::end() {
+  // end the flush-task
+  if (_flushTask != nullptr) {
+    _flushTask->disable();
+    delete _flushTask;
+    _flushTask = nullptr;
+  }
+  flush();
+}
+
+ConfigStore::Config& ConfigStore::edit() {
+  _configDirty = true;
+  _touch();
+  return _config;
+}
+
+void ConfigStore::setJournal(const PositionRecord& journal) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (memcmp(&_journal, &journal, sizeof(journal)) != 0) {
+    _journal = journal;
+    _journalDirty = true;
+    _touch();
+  }
+}
+
+void ConfigStore::flush() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_configDirty && !_journalDirty)
+    return;
+
+  LOGD(TAG, "Writing%s%s", _configDirty ? " config" : "", _journalDirty ? " journal" : "");
+  Preferences preferences;
+  preferences.begin("tdrive", false);
+  if (_configDirty)
+    preferences.putBytes("config", &_config, sizeof(_config));
+  if (_journalDirty)
+    preferences.putBytes("posrec", &_journal, sizeof(_journal));
+  preferences.end();
+  _configDirty = false;
+  _journalDirty = false;
+}
+
+// write after the quiet period, unless busy
+void ConfigStore::_flushBehind() {
+  if (_busy != nullptr && _busy()) {
+    _flushTask->restartDelayed(CONFIG_FLUSH_MS);
+    return;
+  }
+  flush();
+}
+
+// (re-)start the quiet period
+void ConfigStore::_touch() {
+  if (_flushTask != nullptr)
+    _flushTask->restartDelayed(CONFIG_FLUSH_MS);
+}
+
+ConfigStore::Config ConfigStore::_defaults() {
+  Config config = {};
+  config.version = Config::VERSION;
+  config.speed = 30;
+  config.acceleration = 300;
+  config.jogTimeout = JOG_TIMEOUT_MS;
+  config.positionDeadband = TELEMETRY_POSITION_DEADBAND;
+  config.speedDeadband = TELEMETRY_SPEED_DEADBAND;
+  config.stallThreshold = STALL_HOMING_THRESHOLD;
+  config.stealthChopThreshold = STEALTHCHOP_THRSH;
+  config.coolStepThreshold = COOLSTEP_THRSH;
+  config.shaperFrequency = SHAPER_DEFAULT_FREQUENCY;
+  config.shaperDamping = SHAPER_DEFAULT_DAMPING;
+  config.coolStepMin = COOLSTEP_SEMIN;
+  config.coolStepMax = COOLSTEP_SEMAX;
+  config.currentAcceleration = CURRENT_ACCELERATION_PERCENT;
+  config.currentCruise = CURRENT_CRUISE_PERCENT;
+  config.currentHold = CURRENT_HOLD_PERCENT;
+  config.stallPolicy = static_cast<uint8_t>(Stepper::StallPolicy::STOP);
+  return config;
+}
+
+// take over the single keys of older firmware (or the defaults)
+void ConfigStore::_migrate() {
+  LOGI(TAG, "Migrating config to version %d", Config::VERSION);
+  Preferences preferences;
+  preferences.begin("tdrive", false);
+  _config = _defaults();
+  _config.speed = preferences.getInt("speed", _config.speed);
+  _config.acceleration = preferences.getInt("acc", _config.acceleration);
+  _config.autoHome = preferences.getBool("ahome", false);
+  _config.holdPosition = preferences.getBool("hold", false);
+  _config.jogTimeout = preferences.getUInt("jogto", _config.jogTimeout);
+  _config.positionDeadband = preferences.getUInt("pdband", _config.positionDeadband);
+  _config.speedDeadband = preferences.getUInt("sdband", _config.speedDeadband);
+  _config.pwmGradient = preferences.getUChar("pwmgrad", 0);
+  _config.pwmOffset = preferences.getUChar("pwmofs", 0);
+  _config.pwmHash = preferences.getUInt("pwmhash", 0);
+  for (const char* key : {"speed", "acc", "ahome", "hold", "jogto", "pdband", "sdband", "pwmgrad", "pwmofs", "pwmhash"}) {
+    preferences.remove(key);
+  }
+  preferences.putBytes("config", &_config, sizeof(_config));
+  preferences.end();
+  _configDirty = false;
+}
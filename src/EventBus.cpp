@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+
+#include <thingy.h>
+
+#define TAG "EventBus"
+
+void EventBus::begin(Scheduler* scheduler) {
+  // Task handling
+  _scheduler = scheduler;
+  _sr.setWaiting();
+  _dropped = 0;
+  _moveStatePending = false;
+  _resyncPending = false;
+
+  // fixed-capacity queue, events are copied in and out
+  if (_queue == nullptr)
+    _queue = xQueueCreate(EVENT_BUS_CAPACITY, sizeof(MotorEvent));
+
+  // create and run a task for handing out the events to the subscribers
+  _dispatchTask = new Task(TASK_IMMEDIATE, TASK_FOREVER, [&] { _dispatchCallback(); }, _scheduler, false, NULL, NULL, true);
+  _dispatchTask->enable();
+  _dispatchTask->waitFor(&_sr);
+}
+
+void EventBus::end() {
+  // end the dispatch-task
+  if (_dispatchTask != nullptr) {
+    _dispatchTask->disable();
+    _dispatchTask = nullptr;
+  }
+  _subscribers.clear();
+  if (_queue != nullptr)
+    xQueueReset(_queue);
+}
+
+bool EventBus::publish(const MotorEvent& event) {
+  _updateSnapshot(event);
+  if (event.type == MotorEvent::Type::MOVE_STATE) {
+    // only the latest telemetry is of interest, it's taken from the snapshot
+    _moveStatePending = true;
+  } else if (_queue == nullptr || xQueueSend(_queue, &event, 0) != pdTRUE) {
+    _dropped++;
+    // the state is sent from the snapshots once the queue is drained
+    if (!_resyncPending.exchange(true))
+      LOGW(TAG, "Event queue is full, resyncing!");
+    return false;
+  }
+
+  // wake up the dispatch-task
+  if (_sr.pending())
+    _sr.signalComplete();
+  return true;
+}
+
+MotorEvent EventBus::getSnapshot(MotorEvent::Type type) {
+  portENTER_CRITICAL(&_snapshotMux);
+  MotorEvent event = _snapshots[static_cast<uint8_t>(type)];
+  portEXIT_CRITICAL(&_snapshotMux);
+  event.type = type;
+  return event;
+}
+
+void EventBus::_updateSnapshot(const MotorEvent& event) {
+  portENTER_CRITICAL(&_snapshotMux);
+  MotorEvent& snapshot = _snapshots[static_cast<uint8_t>(event.type)];
+  if (event.type != MotorEvent::Type::MOTOR_STATE) {
+    snapshot = event;
+  } else {
+    // move state and destination are kept until given again
+    snapshot.state = event.state;
+    snapshot.motorState = event.motorState;
+    snapshot.parts |= event.parts & (MotorEvent::MOVE_STATE | MotorEvent::DESTINATION);
+    if (event.parts & MotorEvent::MOVE_STATE) {
+      snapshot.moveState.position = event.moveState.position;
+      snapshot.moveState.speed = event.moveState.speed;
+      // (it's the latest telemetry as well)
+      _snapshots[static_cast<uint8_t>(MotorEvent::Type::MOVE_STATE)].moveState.position = event.moveState.position;
+      _snapshots[static_cast<uint8_t>(MotorEvent::Type::MOVE_STATE)].moveState.speed = event.moveState.speed;
+    }
+    if (event.parts & MotorEvent::DESTINATION)
+      snapshot.destination = event.destination;
+  }
+  portEXIT_CRITICAL(&_snapshotMux);
+}
+
+void EventBus::_dispatchCallback() {
+  // (events published while dispatching will trigger the next run)
+  _sr.setWaiting();
+
+  MotorEvent event;
+  while (xQueueReceive(_queue, &event, 0) == pdTRUE) {
+    for (const Subscriber& subscriber : _subscribers) {
+      subscriber(event);
+    }
+  }
+
+  // events were dropped, the latest of each type is sent again
+  if (_resyncPending.exchange(false)) {
+    _moveStatePending = true;
+    for (uint8_t type = 0; type < MotorEvent::TYPE_COUNT; type++) {
+      if (type == static_cast<uint8_t>(MotorEvent::Type::MOVE_STATE))
+        continue;
+      event = getSnapshot(static_cast<MotorEvent::Type>(type));
+      for (const Subscriber& subscriber : _subscribers) {
+        subscriber(event);
+      }
+    }
+  }
+
+  // the latest telemetry (it's newer than the events dispatched before)
+  if (_moveStatePending.exchange(false)) {
+    event = getSnapshot(MotorEvent::Type::MOVE_STATE);
+    for (const Subscriber& subscriber : _subscribers) {
+      subscriber(event);
+    }
+  }
+
+  // Wait for the next event...
+  _dispatchTask->waitFor(&_sr);
+}
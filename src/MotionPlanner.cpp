@@ -0,0 +1,384 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+
+#include <MotionPlanner.h>
+#include <math.h>
+
+#include <algorithm>
+
+// amplitudes of ZV, ZVD (Singer & Seering) and EI (as used by Klipper), at half periods of the damped resonance
+void MotionPlanner::setShaper(Shaper shaper, float frequency, float damping) {
+  _impulses[0] = {0, 1};
+  _impulseCount = 1;
+  if (shaper == Shaper::NONE || frequency <= 0 || damping < 0 || damping >= 1)
+    return;
+
+  float dampedFactor = sqrtf(1 - damping * damping);
+  float k = expf(-damping * static_cast<float>(M_PI) / dampedFactor);
+  float halfPeriod = 0.5f / (frequency * dampedFactor);
+  switch (shaper) {
+    case Shaper::ZV:
+      _impulses[1] = {halfPeriod, k};
+      _impulseCount = 2;
+      break;
+    case Shaper::ZVD:
+      _impulses[1] = {halfPeriod, 2 * k};
+      _impulses[2] = {2 * halfPeriod, k * k};
+      _impulseCount = 3;
+      break;
+    default:
+      _impulses[0].amplitude = (1 + PLANNER_EI_TOLERANCE) / 4;
+      _impulses[1] = {halfPeriod, (1 - PLANNER_EI_TOLERANCE) / 2 * k};
+      _impulses[2] = {2 * halfPeriod, (1 + PLANNER_EI_TOLERANCE) / 4 * k * k};
+      _impulseCount = 3;
+      break;
+  }
+
+  // the impulses sum up to 1 (the profile ends at its target)
+  float sum = 0;
+  for (uint8_t i = 0; i < _impulseCount; i++)
+    sum += _impulses[i].amplitude;
+  for (uint8_t i = 0; i < _impulseCount; i++)
+    _impulses[i].amplitude /= sum;
+}
+
+bool MotionPlanner::plan(int32_t startPosition, const std::vector<Waypoint>& waypoints, uint32_t jerk) {
+  abort();
+  _jerk = jerk;
+
+  // split the path into segments (without zero-length ones)
+  struct Segment {
+      int32_t from;
+      int32_t to;
+      float maxSpeed;
+      float acceleration;
+      float entrySpeed;
+      float exitSpeed;
+  };
+  std::vector<Segment> segments;
+  segments.reserve(waypoints.size());
+  int32_t from = startPosition;
+  for (const Waypoint& waypoint : waypoints) {
+    if (waypoint.speed == 0 || waypoint.acceleration == 0)
+      return false;
+    if (waypoint.position == from)
+      continue;
+    segments.push_back({from, waypoint.position, static_cast<float>(waypoint.speed), static_cast<float>(waypoint.acceleration), 0, 0});
+    from = waypoint.position;
+  }
+
+  _emittedPosition = startPosition;
+  _targetPosition = from;
+  _phases.clear();
+  _duration = 0;
+  _time = 0;
+  _shaped = isShaping();
+
+  // already there
+  if (segments.empty())
+    return true;
+
+  // junctions are passed at the slower speed of both segments, reversals need a full stop
+  for (size_t i = 0; i + 1 < segments.size(); i++) {
+    bool sameDirection = (segments[i].to > segments[i].from) == (segments[i + 1].to > segments[i + 1].from);
+    float junctionSpeed = sameDirection ? std::min(segments[i].maxSpeed, segments[i + 1].maxSpeed) : 0;
+    segments[i].exitSpeed = junctionSpeed;
+    segments[i + 1].entrySpeed = junctionSpeed;
+  }
+
+  // backward pass: each segment must be able to slow down to its exit speed
+  for (size_t i = segments.size(); i-- > 0;) {
+    float reachable = _reachableSpeed(segments[i].exitSpeed, abs(segments[i].to - segments[i].from), segments[i].acceleration);
+    if (segments[i].entrySpeed > reachable) {
+      segments[i].entrySpeed = reachable;
+      if (i > 0)
+        segments[i - 1].exitSpeed = reachable;
+    }
+  }
+
+  // forward pass: each segment must be able to speed up to its exit speed
+  for (size_t i = 0; i < segments.size(); i++) {
+    float reachable = _reachableSpeed(segments[i].entrySpeed, abs(segments[i].to - segments[i].from), segments[i].acceleration);
+    if (segments[i].exitSpeed > reachable) {
+      segments[i].exitSpeed = reachable;
+      if (i + 1 < segments.size())
+        segments[i + 1].entrySpeed = reachable;
+    }
+  }
+
+  _phases.reserve(segments.size() * (_jerk > 0 ? 7 : 3));
+  for (const Segment& segment : segments) {
+    _addSegment(segment.from, segment.to, segment.entrySpeed, segment.exitSpeed, segment.maxSpeed, segment.acceleration);
+  }
+
+  _countUp = segments.front().to > segments.front().from;
+  _active = !_phases.empty();
+  return true;
+}
+
+// time for changing the speed (with limited jerk, if set)
+float MotionPlanner::_rampTime(float fromSpeed, float toSpeed, float acceleration) {
+  float delta = fabsf(toSpeed - fromSpeed);
+  if (_jerk <= 0)
+    return delta / acceleration;
+
+  // small changes of speed won't reach the full acceleration
+  float peakAcceleration = std::min(acceleration, sqrtf(delta * _jerk));
+  if (peakAcceleration <= 0)
+    return 0;
+  return delta / peakAcceleration + peakAcceleration / _jerk;
+}
+
+// distance for changing the speed, the profiles are symmetric
+float MotionPlanner::_rampDistance(float fromSpeed, float toSpeed, float acceleration) {
+  return (fromSpeed + toSpeed) / 2 * _rampTime(fromSpeed, toSpeed, acceleration);
+}
+
+// highest speed to change to within the given length
+float MotionPlanner::_reachableSpeed(float fromSpeed, float length, float acceleration) {
+  float reachable = sqrtf(fromSpeed * fromSpeed + 2 * acceleration * length);
+  if (_jerk <= 0)
+    return reachable;
+
+  // no closed form with limited jerk, bisect
+  float lower = fromSpeed;
+  for (int i = 0; i < 24; i++) {
+    float speed = (lower + reachable) / 2;
+    if (_rampDistance(fromSpeed, speed, acceleration) > length) {
+      reachable = speed;
+    } else {
+      lower = speed;
+    }
+  }
+  return lower;
+}
+
+// add a phase with constant jerk and advance the state to its end
+void MotionPlanner::_addPhase(State* state, float duration, float jerk) {
+  if (duration <= 1e-6f)
+    return;
+
+  _phases.push_back({_duration, duration, state->position, state->speed, state->acceleration, jerk});
+  _duration += duration;
+  state->position += state->speed * duration + state->acceleration * duration * duration / 2 + jerk * duration * duration * duration / 6;
+  state->speed += state->acceleration * duration + jerk * duration * duration / 2;
+  state->acceleration += jerk * duration;
+}
+
+// add a change of speed (with limited jerk, if set), speeds are absolute values
+void MotionPlanner::_addRamp(State* state, float direction, float toSpeed, float acceleration) {
+  float fromSpeed = fabsf(state->speed);
+  float delta = fabsf(toSpeed - fromSpeed);
+  float sign = toSpeed > fromSpeed ? direction : -direction;
+
+  if (_jerk <= 0) {
+    state->acceleration = sign * acceleration;
+    _addPhase(state, delta / acceleration, 0);
+  } else {
+    // raise acceleration, keep it, lower it again (S-curve)
+    float peakAcceleration = std::min(acceleration, sqrtf(delta * _jerk));
+    if (peakAcceleration > 0) {
+      float jerkTime = peakAcceleration / _jerk;
+      state->acceleration = 0;
+      _addPhase(state, jerkTime, sign * _jerk);
+      state->acceleration = sign * peakAcceleration;
+      _addPhase(state, delta / peakAcceleration - jerkTime, 0);
+      _addPhase(state, jerkTime, -sign * _jerk);
+    }
+  }
+
+  // don't let rounding errors pile up
+  state->speed = direction * toSpeed;
+  state->acceleration = 0;
+}
+
+// add a (jerk limited) trapezoidal profile from one position to another
+void MotionPlanner::_addSegment(int32_t from, int32_t to, float entrySpeed, float exitSpeed, float maxSpeed, float acceleration) {
+  float direction = to > from ? 1 : -1;
+  float length = abs(to - from);
+
+  // highest speed on the segment (might not reach maxSpeed on short segments)
+  float lower = std::max(entrySpeed, exitSpeed);
+  float peakSpeed = std::max(std::min(maxSpeed, sqrtf((2 * acceleration * length + entrySpeed * entrySpeed + exitSpeed * exitSpeed) / 2)), lower);
+  if (_jerk > 0 && _rampDistance(entrySpeed, peakSpeed, acceleration) + _rampDistance(peakSpeed, exitSpeed, acceleration) > length) {
+    // no closed form with limited jerk, bisect
+    for (int i = 0; i < 24 && peakSpeed > lower; i++) {
+      float speed = (lower + peakSpeed) / 2;
+      if (_rampDistance(entrySpeed, speed, acceleration) + _rampDistance(speed, exitSpeed, acceleration) > length) {
+        peakSpeed = speed;
+      } else {
+        lower = speed;
+      }
+    }
+    peakSpeed = lower;
+  }
+
+  float cruiseDistance = length - _rampDistance(entrySpeed, peakSpeed, acceleration) - _rampDistance(peakSpeed, exitSpeed, acceleration);
+
+  State state = {static_cast<float>(from), direction * entrySpeed, 0};
+  _addRamp(&state, direction, peakSpeed, acceleration);
+  if (cruiseDistance > 0 && peakSpeed > 0)
+    _addPhase(&state, cruiseDistance / peakSpeed, 0);
+  _addRamp(&state, direction, exitSpeed, acceleration);
+}
+
+// the shaped profile ends after the last impulse has passed the whole profile
+float MotionPlanner::_endTime() {
+  return _duration + (_shaped ? _impulses[_impulseCount - 1].time : 0);
+}
+
+// phase running at the given time (within the profile)
+const MotionPlanner::Phase& MotionPlanner::_phaseAt(float time) {
+  auto next = std::upper_bound(_phases.begin(), _phases.end(), time, [](float t, const Phase& phase) { return t < phase.start; });
+  return next == _phases.begin() ? *next : *(next - 1);
+}
+
+// position at the given time, a sum of delayed copies of the profile when shaped
+float MotionPlanner::_positionAt(float time) {
+  float position = 0;
+  for (uint8_t i = 0; i < (_shaped ? _impulseCount : 1); i++) {
+    float t = time - (_shaped ? _impulses[i].time : 0);
+    float amplitude = _shaped ? _impulses[i].amplitude : 1;
+    if (t >= _duration) {
+      position += amplitude * _targetPosition;
+    } else if (t <= 0) {
+      position += amplitude * _phases.front().position;
+    } else {
+      const Phase& current = _phaseAt(t);
+      t -= current.start;
+      position += amplitude * (current.position + current.speed * t + current.acceleration * t * t / 2 + current.jerk * t * t * t / 6);
+    }
+  }
+  return position;
+}
+
+float MotionPlanner::_speedAt(float time) {
+  float speed = 0;
+  for (uint8_t i = 0; i < (_shaped ? _impulseCount : 1); i++) {
+    float t = time - (_shaped ? _impulses[i].time : 0);
+    if (t > 0 && t < _duration) {
+      const Phase& current = _phaseAt(t);
+      t -= current.start;
+      speed += (_shaped ? _impulses[i].amplitude : 1) * (current.speed + current.acceleration * t + current.jerk * t * t / 2);
+    }
+  }
+  return speed;
+}
+
+// sample the profile into the next queue command
+bool MotionPlanner::_nextCommand() {
+  float endTime = _endTime();
+  if (_phases.empty() || _time >= endTime)
+    return false;
+
+  uint32_t sliceTicks = PLANNER_SLICE_TICKS;
+  float position;
+  float advanced;
+  int32_t steps;
+  while (true) {
+    advanced = static_cast<float>(sliceTicks) / TICKS_PER_S;
+    if (_time + advanced >= endTime) {
+      advanced = endTime - _time;
+      _pendingTime = endTime;
+      position = _targetPosition;
+    } else {
+      _pendingTime = _time + advanced;
+      position = _positionAt(_pendingTime);
+    }
+    steps = lroundf(position) - _emittedPosition;
+    // a single command can take at most 255 steps
+    if (abs(steps) <= 255 || sliceTicks < 2 * MIN_CMD_TICKS)
+      break;
+    sliceTicks /= 2;
+  }
+  steps = constrain(steps, -255, 255);
+
+  uint32_t ticks = advanced * TICKS_PER_S;
+  if (steps == 0) {
+    // nothing left to do at the very end of the profile
+    if (_pendingTime >= endTime || ticks < MIN_CMD_TICKS) {
+      _time = _pendingTime;
+      return _nextCommand();
+    }
+    _pendingCommand.ticks = ticks;
+    _pendingCommand.steps = 0;
+    _pendingCommand.count_up = _countUp;
+  } else {
+    _pendingCommand.steps = abs(steps);
+    _pendingCommand.ticks = std::max(ticks, static_cast<uint32_t>(MIN_CMD_TICKS)) / _pendingCommand.steps;
+    _pendingCommand.count_up = steps > 0;
+  }
+  _hasPendingCommand = true;
+  return true;
+}
+
+// add commands to FastAccelStepper's queue until enough motion is queued
+bool MotionPlanner::fill(FastAccelStepper* stepper) {
+  while (_active) {
+    if (!_hasPendingCommand && !_nextCommand()) {
+      _active = false;
+      break;
+    }
+
+    if (stepper->ticksInQueue() > PLANNER_FILL_TICKS)
+      break;
+
+    int8_t result = stepper->addQueueEntry(&_pendingCommand);
+    if (result == AQE_OK) {
+      _hasPendingCommand = false;
+      _time = _pendingTime;
+      if (_pendingCommand.steps) {
+        _emittedPosition += _pendingCommand.count_up ? _pendingCommand.steps : -_pendingCommand.steps;
+        _countUp = _pendingCommand.count_up;
+      }
+    } else if (result > 0) {
+      // queue full, direction or enable pin busy: try again later
+      break;
+    } else {
+      abort();
+      return false;
+    }
+  }
+  return true;
+}
+
+// replace the remaining profile by a ramp down to standstill, from the actual position and speed of the stepper
+// (the commands already queued can't be withdrawn without losing steps, the ramp continues after them)
+void MotionPlanner::stop(FastAccelStepper* stepper, uint32_t acceleration) {
+  if (!_active)
+    return;
+
+  _hasPendingCommand = false;
+  float speed = stepper->getCurrentSpeedInMilliHz() / 1000.0f;
+  float direction = speed > 0 ? 1 : -1;
+
+  // stopping ignores the jerk limit and the shaper
+  _jerk = 0;
+  _shaped = false;
+  _phases.clear();
+  _duration = 0;
+  _time = 0;
+  State state = {static_cast<float>(stepper->getCurrentPosition()), speed, 0};
+  _addRamp(&state, direction, 0, acceleration);
+  _targetPosition = lroundf(state.position);
+
+  // skip the part of the ramp which is covered by the queue, nothing is left when the queue ends beyond it
+  float queued = direction * (_emittedPosition - stepper->getCurrentPosition());
+  float remaining = speed * speed - 2.0f * acceleration * queued;
+  if (_phases.empty() || direction * (_targetPosition - _emittedPosition) <= 0 || remaining < 0) {
+    _targetPosition = _emittedPosition;
+    abort();
+    return;
+  }
+  _time = queued > 0 ? (fabsf(speed) - sqrtf(remaining)) / acceleration : 0;
+}
+
+void MotionPlanner::abort() {
+  _active = false;
+  _hasPendingCommand = false;
+  _phases.clear();
+  _duration = 0;
+  _time = 0;
+}
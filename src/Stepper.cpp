@@ -4,20 +4,33 @@
  */
 
 #include <FunctionalInterrupt.h>
-#include <Preferences.h>
+#include <esp_rom_crc.h>
 #include <thingy.h>
 
 #include <functional>
 
 #define TAG "Stepper"
 
-void Stepper::begin(Scheduler* scheduler) {
+// survives soft restarts and watchdog resets (but not a power-on)
+RTC_NOINIT_ATTR static PositionRecord rtcPositionRecord;
+
+void Stepper::begin(Scheduler* scheduler, Scheduler* ledScheduler) {
   // Task handling
   _scheduler = scheduler;
+  _ledScheduler = ledScheduler != nullptr ? ledScheduler : scheduler;
+
+  // the LED's tasks can't be touched from another task, sync the mode instead
+  if (_ledScheduler != _scheduler) {
+    _ledSyncTask = new Task(LED_SYNC_MS, TASK_FOREVER, [&] { _syncLEDMode(); }, _ledScheduler, false, NULL, NULL, true);
+    _ledSyncTask->enable();
+  }
   _srHome.setWaiting();
   _srDiag.setWaiting();
   _srHoming.setWaiting();
 
+  // the driver's UART transactions are handled on the same scheduler
+  _stepper_driver.begin(_scheduler);
+
   // Set up IRQ for homing switch
   pinMode(TMC_DIAG, INPUT);
   attachInterrupt(TMC_DIAG, [&] { _isrDiag(); }, RISING);
@@ -28,6 +41,7 @@ void Stepper::begin(Scheduler* scheduler) {
   _movementDirection = MotorDirection::STANDSTILL;
 
   // Set up IRQ for homing button
+  _homeLatched = false;
   pinMode(TMC_HOME, INPUT);
   attachInterrupt(TMC_HOME, [&] { _isrHome(); }, FALLING);
   // create and run a task for for getting home button presses
@@ -37,16 +51,71 @@ void Stepper::begin(Scheduler* scheduler) {
 
   // register listener to website
   LOGD(TAG, "register event handler to website");
-  webSite.listenWebEvent([&](JsonDocument doc) { _webEventCallback(doc); });
+  webSite.listenWebEvent([&](const MotorCommand& command) { _webEventCallback(command); });
+
+  // create and run a task for handling the received commands
+  _commandTask = new Task(COMMAND_POLL_MS, TASK_FOREVER, [&] { _commandCallback(); }, _scheduler, false, NULL, NULL, true);
+  _commandTask->enable();
 
   // handle persistent options (auto homing...)
-  LOGD(TAG, "Get persistent options from preferences...");
-  Preferences preferences;
-  preferences.begin("tdrive", true);
-  _destination_speed = preferences.getInt("speed", 30);
-  _destination_acceleration = preferences.getInt("acc", 300);
-  _autoHome = preferences.getBool("ahome", false);
-  preferences.end();
+  _configStore.begin(_scheduler, [&] { return _stepper->isRunning() || _planner.isActive(); });
+  const ConfigStore::Config& config = _configStore.get();
+  _destination_speed = config.speed;
+  _destination_acceleration = config.acceleration;
+  _autoHome = config.autoHome;
+  _jogTimeout = config.jogTimeout;
+  _positionDeadband = config.positionDeadband;
+  _speedDeadband = config.speedDeadband;
+  _holdPosition = config.holdPosition;
+  _homingMode = static_cast<HomingMode>(config.homingMode);
+  _stallThreshold = config.stallThreshold;
+  _strokeLength = config.strokeLength;
+  _maxSpeed = config.maxSpeed;
+  _maxAcceleration = config.maxAcceleration;
+  _stealthChopThreshold = config.stealthChopThreshold;
+  _coolStepThreshold = config.coolStepThreshold;
+  _shaper = static_cast<MotionPlanner::Shaper>(config.shaper);
+  _shaperFrequency = config.shaperFrequency;
+  _shaperDamping = config.shaperDamping;
+  _planner.setShaper(_shaper, _shaperFrequency, _shaperDamping);
+  _resonanceMap = config.resonanceMap;
+  _coolStepMin = config.coolStepMin;
+  _coolStepMax = config.coolStepMax;
+  _currentAcceleration = config.currentAcceleration;
+  _currentCruise = config.currentCruise;
+  _currentHold = config.currentHold;
+  _stallPolicy = static_cast<StallPolicy>(config.stallPolicy);
+  // the PWM calibration is only valid for the same driver config
+  _pwmCalibrated = config.pwmHash == _pwmConfigHash();
+  if (_pwmCalibrated) {
+    _pwmGradient = config.pwmGradient;
+    _pwmOffset = config.pwmOffset;
+  }
+
+  // create a (stopped) task for bringing jogging to halt
+  _jogging = false;
+  _jogWatchdogTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _jogWatchdogCallback(); }, _scheduler, false);
+
+  // create a (stopped) task for watching the phases of homing
+  _switchHoming = SwitchHoming::NONE;
+  _stallHoming = StallHoming::NONE;
+  _homingCheckTask = new Task(HOMING_CHECK_MS, TASK_FOREVER, [&] { _homingCheckCallback(); }, _scheduler, false);
+
+  // create a (stopped) task for characterizing the limits
+  _characterization = {};
+  _characterizeTask = new Task(CHARACTERIZE_SAMPLE_MS, TASK_FOREVER, [&] { _characterizeCallback(); }, _scheduler, false);
+
+  // create a (stopped) task for calibrating the input shaper
+  _shaperCalibration = {};
+  _shaperCalibrateTask = new Task(CHARACTERIZE_SAMPLE_MS, TASK_FOREVER, [&] { _shaperCalibrateCallback(); }, _scheduler, false);
+
+  // create a (stopped) task for detecting stalls while moving (and recovering from them)
+  _stallRecovery = StallRecovery::NONE;
+  _stallMonitorTask = new Task(STALL_MONITOR_MS, TASK_FOREVER, [&] { _stallMonitorCallback(); }, _scheduler, false);
+
+  // create and run a task for sending position and speed (also between moves)
+  _checkMovementTask = new Task(TELEMETRY_IDLE_MS, TASK_FOREVER, [&] { _checkMovementCallback(); }, _scheduler, false, NULL, NULL, true);
+  _checkMovementTask->enable();
 
   // Set up a task for initializing the motor
   _initializationState = InitializationState::UNITITIALIZED;
@@ -55,10 +124,33 @@ void Stepper::begin(Scheduler* scheduler) {
   Task* initTMC2209Task = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _initTMC2209(); }, _scheduler, false, NULL, NULL, true);
   initTMC2209Task->enable();
   initTMC2209Task->waitFor(webSite.getStatusRequest());
+
+  // the first snapshots for clients connecting (kept up to date by the events)
+  eventBus.publish(configEvent());
+  eventBus.publish(thermalEvent());
+  MotorEvent event = _motorStateEvent(_motorState);
+  event.setMoveState(_destination_position, 0, _telemetryCurrentScale);
+  event.setDestination(_destination_position, _destination_speed, _destination_acceleration, _destination_jerk);
+  eventBus.publish(event);
 }
 
 void Stepper::end() {
-  _motorEventCallback = nullptr;
+  // the tasks, the driver and FastAccelStepper belong to the scheduler's task, others hand over and wait
+  if (_commandTask != nullptr && xTaskGetCurrentTaskHandle() != _schedulerTask) {
+    _endRequested.store(true, std::memory_order_release);
+    for (uint32_t waited = 0; _endRequested.load(std::memory_order_acquire); waited++) {
+      if (waited >= END_TIMEOUT_MS) {
+        LOGW(TAG, "Ending timed out!");
+        return;
+      }
+      vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    return;
+  }
+  _end();
+}
+
+void Stepper::_end() {
   _srHome.setWaiting();
   _srDiag.setWaiting();
   _srHoming.setWaiting();
@@ -78,54 +170,163 @@ void Stepper::end() {
     _homingIRQTask = nullptr;
   }
 
+  // end the jog-watchdog
+  if (_jogWatchdogTask != nullptr) {
+    _jogWatchdogTask->disable();
+    delete _jogWatchdogTask;
+    _jogWatchdogTask = nullptr;
+  }
+  _jogging = false;
+
+  // end the stall-check-task
+  if (_homingCheckTask != nullptr) {
+    _homingCheckTask->disable();
+    delete _homingCheckTask;
+    _homingCheckTask = nullptr;
+  }
+  _switchHoming = SwitchHoming::NONE;
+  _stallHoming = StallHoming::NONE;
+
+  // end the characterize-task
+  if (_characterizeTask != nullptr) {
+    _characterizeTask->disable();
+    delete _characterizeTask;
+    _characterizeTask = nullptr;
+  }
+  _characterization = {};
+
+  // end the shaper-calibration-task
+  if (_shaperCalibrateTask != nullptr) {
+    _shaperCalibrateTask->disable();
+    delete _shaperCalibrateTask;
+    _shaperCalibrateTask = nullptr;
+  }
+  _shaperCalibration = {};
+
+  // end the stall-monitor-task
+  if (_stallMonitorTask != nullptr) {
+    _stallMonitorTask->disable();
+    delete _stallMonitorTask;
+    _stallMonitorTask = nullptr;
+  }
+  _stallRecovery = StallRecovery::NONE;
+
+  // end the LED-sync-task
+  if (_ledSyncTask != nullptr) {
+    _ledSyncTask->disable();
+    _ledSyncTask = nullptr;
+  }
+
+  // end the command-task
+  if (_commandTask != nullptr) {
+    _commandTask->disable();
+    _commandTask = nullptr;
+  }
+
+  // end the telemetry-task
+  if (_checkMovementTask != nullptr) {
+    _checkMovementTask->disable();
+    _checkMovementTask = nullptr;
+  }
+
   // end the check-task
   if (_checkTMC2209Task != nullptr) {
     _checkTMC2209Task->disable();
     _checkTMC2209Task = nullptr;
   }
 
-  // software-disable the driver
-  _stepper_driver.disable();
-
   // possibly stop an ongoing movement
+  _planner.abort();
   _stepper->forceStop();
   _movementDirection = MotorDirection::STANDSTILL;
+
+  // keep holding the retained position (e.g. for a restart), otherwise software-disable the driver
+  // (recorded by the scheduler's task, see end())
+  if (_holdPosition && _homed && _driverComState == DriverComState::OK && !_stepper->isRunning()) {
+    _recordPosition();
+  } else {
+    _invalidatePosition();
+    _stepper_driver.disable();
+    _stepper_driver.flush();
+  }
+  _stepper_driver.end();
+
+  // write pending changes now
+  _configStore.end();
 }
 
 // callback when homing button was hit
 void Stepper::_homingIRQCallback() {
-  // Stop the current movement, when moving towards home
-  if (_movementDirection == MotorDirection::BACKWARDS) {
-    // ALWAYS stop and always remember that we hit the home button
-    // adding a safety margin 0f 0.5mm
-    _stepper->forceStopAndNewPosition(-STEPS_PER_MM / 2);
+  // the movement towards home was stopped by the ISR already, it's handled when the stepper came to a halt
+  if (_homeLatched) {
+    if (_homeLatch.taskLatency == 0)
+      _homeLatch.taskLatency = esp_timer_get_time() - _homeLatch.time;
+    _planner.abort();
+    if (_stepper->isRunning()) {
+      _srHome.setWaiting();
+      _srHome.signalComplete();
+      _homingIRQTask->waitFor(&_srHome);
+      return;
+    }
+    _trackHomeLatency();
+  }
+
+  if (_homeLatched && (_switchHoming == SwitchHoming::APPROACH || _switchHoming == SwitchHoming::PRE_POSITION)) {
+    // the fast approach only finds the switch, back off and re-approach slowly
+    LOGD(TAG, "Hit Home fast, re-approaching");
+    _homeLatched = false;
+    _startBackOff();
+  } else if (_homeLatched) {
+    // ALWAYS remember that we hit the home button, the latched step count is the reference
+    // adding a safety margin 0f 0.5mm (and the steps of commands queued after the ISR stopped, see _feedQueueCallback)
+    int32_t switchPosition = _toMicrosteps(_homeLatch.position);
+    bool wasHomed = _homed;
+    int32_t position = -STEPS_PER_MM / 2 + _currentPosition() - switchPosition;
+    _homeLatched = false;
     _homed = true;
     _destination_position = 0;
     _movementDirection = MotorDirection::STANDSTILL;
-    _stepper->moveTo(0);
+    if (_microsteps != USTEPS_PER_STEP) {
+      // a fast move ran into the switch, native µSteps are written before moving on
+      _microstepSwitch = MicrostepSwitch::NONE;
+      _setMicrosteps(USTEPS_PER_STEP, position);
+      _stepper_driver.flush([&](bool) { _stepper->moveTo(0); });
+    } else {
+      _stepper->forceStopAndNewPosition(position);
+      _stepper->moveTo(0);
+    }
 
     // we're initializing right now
     if (_initializationState == InitializationState::GRADIENT_HOMING) {
       _initializationState = InitializationState::GRADIENT_HOME;
       LOGI(TAG, "Hit Home while initializing");
     } else { // Initialization is probably done already
+      // the switch takes precedence over sensorless homing
+      if (_stallHoming != StallHoming::NONE)
+        _endStallHoming();
+      if (_switchHoming == SwitchHoming::CREEP) {
+        // lost steps show up as a deviation from the known home
+        _homeDeviation = wasHomed ? switchPosition + STEPS_PER_MM / 2 : 0;
+        if (wasHomed)
+          LOGI(TAG, "Home deviated from the known one by %d µSteps", _homeDeviation);
+      } else if (_characterization.phase != Characterization::NONE) {
+        // a test move ran into the switch
+        _characterization.switchHit = true;
+      }
+      _switchHoming = SwitchHoming::NONE;
+      _homingCheckTask->disable();
+
       // Yeah, homing is done!
       if (_motorState == MotorState::HOMING) {
         LOGI(TAG, "Hit Home while homing");
         _motorState = MotorState::IDLE;
         _movementDirection = MotorDirection::STANDSTILL;
-        led.setMode(LED::LEDMode::IDLE);
+        _setLEDMode(LED::LEDMode::IDLE);
 
         // send websock event
-        if (_motorEventCallback != nullptr) {
-          JsonDocument jsonMsg;
-          jsonMsg["type"] = "motor_state";
-          jsonMsg["state"] = MotorState_string_map[MotorState::HOMED].c_str();
-          jsonMsg["move_state"]["position"] = 0;
-          jsonMsg["move_state"]["speed"] = 0;
-          jsonMsg.shrinkToFit();
-          _motorEventCallback(jsonMsg);
-        }
+        MotorEvent event = _motorStateEvent(MotorState::HOMED);
+        event.setMoveState(0, 0, _telemetryCurrentScale);
+        eventBus.publish(event);
       } else if (_motorState == MotorState::DRIVING) {
         LOGW(TAG, "Hit Home while driving");
         // bring the motor to halt now
@@ -134,36 +335,58 @@ void Stepper::_homingIRQCallback() {
     }
   }
 
-  // Wait for the next event...
+  // Wait for the next event... (unless the ISR latched meanwhile)
   _srHome.setWaiting();
+  if (_homeLatched)
+    _srHome.signalComplete();
   _homingIRQTask->waitFor(&_srHome);
 }
 
+// worst case from hitting the switch until the movement stopped (ISR) and until handled (scheduler)
+void Stepper::_trackHomeLatency() {
+  if (_homeLatch.stopLatency > _homeStopLatencyMax || _homeLatch.taskLatency > _homeTaskLatencyMax) {
+    _homeStopLatencyMax = max(_homeStopLatencyMax, _homeLatch.stopLatency);
+    _homeTaskLatencyMax = max(_homeTaskLatencyMax, _homeLatch.taskLatency);
+    LOGI(TAG, "Home switch worst case: stopped after %u µs, handled after %u µs", _homeStopLatencyMax, _homeTaskLatencyMax);
+  }
+  LOGD(TAG, "Home switch: stopped after %u µs, handled after %u µs", _homeLatch.stopLatency, _homeLatch.taskLatency);
+}
+
 void Stepper::_diagIRQCallback() {
-  // find what happened
+  if (_stallHoming == StallHoming::HOME || _stallHoming == StallHoming::FAR_END) {
+    // a stall while homing sensorless (StallGuard isn't reliable before reaching the homing speed)
+    if ((_stepper->rampState() & RAMP_STATE_MASK) == RAMP_STATE_COAST)
+      _stallDetected();
+  } else {
+    // find what happened (reading everything needed at once)
+    _stepper_driver.refresh(TMC2209Driver::REFRESH_COMMUNICATION | TMC2209Driver::REFRESH_GLOBAL_STATUS | TMC2209Driver::REFRESH_DRIVER_STATUS, [&](bool) { _diagnoseTMC2209(); });
+  }
+
+  // Wait for the next event...
+  _srDiag.setWaiting();
+  _diagIRQTask->waitFor(&_srDiag);
+}
+
+// called when the status was read after a diagnostic event
+void Stepper::_diagnoseTMC2209() {
   if (!_stepper_driver.isCommunicating()) {
     _driverComState = DriverComState::ERROR;
     _motorState = MotorState::ERROR;
-    led.setMode(LED::LEDMode::ERROR);
+    _setLEDMode(LED::LEDMode::ERROR);
     LOGW(TAG, "Loss of motor power");
 
-    // execute callback (from website)
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = getMotorState_as_string().c_str();
-      jsonMsg["error"] = DriverError_string_map[DriverError::POWER].c_str();
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
+    // send websock event
+    MotorEvent event = _motorStateEvent(_motorState);
+    event.error = DriverError_string_map[DriverError::POWER].c_str();
+    eventBus.publish(event);
   } else {
     // Get global status of TMC2209
-    TMC2209::GlobalStatus globalStatus = _stepper_driver.getGlobalStatus();
+    TMC2209Driver::GlobalStatus globalStatus = _stepper_driver.getGlobalStatus();
     if (globalStatus.uv_cp) {
       LOGW(TAG, "Charge pump under-voltage");
     } else if (globalStatus.drv_err) {
       // Some error has occurred...
-      TMC2209::Status status = _stepper_driver.getStatus();
+      TMC2209Driver::Status status = _stepper_driver.getStatus();
       if (status.low_side_short_a) {
         LOGW(TAG, "low_side_short_a");
       } else if (status.low_side_short_b) {
@@ -184,12 +407,63 @@ void Stepper::_diagIRQCallback() {
     } else if (digitalRead(TMC_EN)) {
       LOGW(TAG, "Motor is hardware-disabled");
     }
+    // derating (or stopping) by the temperature
+    _checkThermal();
   }
   // TODO(me): handle diagnostics
+}
 
-  // Wait for the next event...
-  _srDiag.setWaiting();
-  _diagIRQTask->waitFor(&_srDiag);
+void Stepper::setJogTimeout(uint32_t jogTimeout) {
+  LOGI(TAG, "Jog timeout: %d ms", jogTimeout);
+  // save if value differs from known
+  if (_jogTimeout != jogTimeout) {
+    _jogTimeout = jogTimeout;
+    _configStore.edit().jogTimeout = _jogTimeout;
+  }
+}
+
+void Stepper::_setLEDMode(LED::LEDMode mode) {
+  _ledMode = mode;
+  if (_ledSyncTask == nullptr)
+    led.setMode(mode);
+}
+
+// only changes are passed on, the mode might be set by others (network, restart,...) meanwhile
+void Stepper::_syncLEDMode() {
+  LED::LEDMode mode = _ledMode;
+  if (mode != _ledModeSynced) {
+    _ledModeSynced = mode;
+    led.setMode(mode);
+  }
+}
+
+MotorEvent Stepper::_motorStateEvent(MotorState state) {
+  MotorEvent event = {};
+  event.type = MotorEvent::Type::MOTOR_STATE;
+  event.state = static_cast<uint8_t>(state);
+  event.motorState = static_cast<uint8_t>(_motorState);
+  event.origin = -1;
+  return event;
+}
+
+MotorEvent Stepper::configEvent() {
+  MotorEvent event = {};
+  event.type = MotorEvent::Type::CONFIG;
+  event.origin = -1;
+  event.config = {_autoHome, _jogTimeout, _positionDeadband, _speedDeadband, _holdPosition, static_cast<uint8_t>(_homingMode), _stallThreshold, _strokeLength, _maxSpeed, _maxAcceleration, _stealthChopThreshold, _coolStepThreshold, static_cast<uint8_t>(_shaper), _shaperFrequency, _shaperDamping, _resonanceMap, _coolStepMin, _coolStepMax, _currentAcceleration, _currentCruise, _currentHold, static_cast<uint8_t>(_stallPolicy)};
+  return event;
+}
+
+void Stepper::setTelemetryDeadband(uint32_t position, uint32_t speed) {
+  LOGI(TAG, "Telemetry deadband: %d mm, %d mm/s", position, speed);
+  // save if values differ from known
+  if (_positionDeadband != position || _speedDeadband != speed) {
+    _positionDeadband = position;
+    _speedDeadband = speed;
+    ConfigStore::Config& config = _configStore.edit();
+    config.positionDeadband = _positionDeadband;
+    config.speedDeadband = _speedDeadband;
+  }
 }
 
 void Stepper::setAutoHome(bool autoHome) {
@@ -197,203 +471,1188 @@ void Stepper::setAutoHome(bool autoHome) {
   // save if value differs from known
   if (_autoHome != autoHome) {
     _autoHome = autoHome;
-    Preferences preferences;
-    preferences.begin("tdrive", false);
-    preferences.putBool("ahome", _autoHome);
-    preferences.end();
+    _configStore.edit().autoHome = _autoHome;
   }
 }
 
-// re-Initialization
-void Stepper::_reInitTMC2209() {
-  LOGI(TAG, "Running TMC2209 re-initialization routine...");
-  // 16 µSteps & 1.8°/per step --> 3200 (200*16) µSteps per rev --> with 8mm pitch --> 400 µSteps per mm
-  _stepper_driver.setMicrostepsPerStep(USTEPS_PER_STEP);
+void Stepper::setHoldPosition(bool holdPosition) {
+  LOGI(TAG, "Hold position: %s", holdPosition ? "On" : "Off");
+  // save if value differs from known
+  if (_holdPosition != holdPosition) {
+    _holdPosition = holdPosition;
+    _configStore.edit().holdPosition = _holdPosition;
+    if (_initializationState == InitializationState::OK)
+      _applyStandstillMode();
+  }
+}
 
-  // configure TMC
-  _stepper_driver.useExternalSenseResistors();
-  // calculated for: [E Series Nema 17 Stepper 2A 55Ncm 1.8°](https://www.omc-stepperonline.com/e-series-nema-17-bipolar-55ncm-77-88oz-in-2a-42x48mm-4-wires-w-1m-cable-connector-17he19-2004s)
-  // using the [TMC2209 Calculator](https://www.analog.com/media/en/engineering-tools/design-tools/tmc2209_calculations.xlsx)
-  _stepper_driver.setRMSCurrent(1414, 0.11);
+bool Stepper::getHomingMode_from_string(const char* name, HomingMode* mode) {
+  for (const auto& entry : HomingMode_string_map) {
+    if (entry.second == name) {
+      *mode = entry.first;
+      return true;
+    }
+  }
+  return false;
+}
 
-  // activate StealthChop
-  _stepper_driver.setStealthChopDurationThreshold(STEALTHCHOP_THRSH);
-  _stepper_driver.enableStealthChop();
+void Stepper::setLimits(int32_t maxSpeed, int32_t maxAcceleration) {
+  LOGI(TAG, "Limits: %d mm/s, %d mm/ss", maxSpeed, maxAcceleration);
+  // save if values differ from known
+  if (_maxSpeed != maxSpeed || _maxAcceleration != maxAcceleration) {
+    _maxSpeed = maxSpeed;
+    _maxAcceleration = maxAcceleration;
+    ConfigStore::Config& config = _configStore.edit();
+    config.maxSpeed = _maxSpeed;
+    config.maxAcceleration = _maxAcceleration;
+  }
+}
 
-  // deactivate CoolStep
-  _stepper_driver.setCoolStepDurationThreshold(STEALTHCHOP_THRSH + 1);
-  _stepper_driver.disableCoolStep();
+bool Stepper::getChopperMode_from_string(const char* name, ChopperMode* mode) {
+  for (const auto& entry : ChopperMode_string_map) {
+    if (entry.second == name) {
+      *mode = entry.first;
+      return true;
+    }
+  }
+  return false;
+}
 
-  // set power saving standstill mode
-  _stepper_driver.setStandstillMode(TMC2209::StandstillMode::BRAKING);
+void Stepper::setChopperThresholds(uint32_t stealthChopThreshold, uint32_t coolStepThreshold) {
+  LOGI(TAG, "Chopper thresholds: TPWMTHRS %d, TCOOLTHRS %d", stealthChopThreshold, coolStepThreshold);
+  // save if values differ from known
+  if (_stealthChopThreshold != stealthChopThreshold || _coolStepThreshold != coolStepThreshold) {
+    _stealthChopThreshold = stealthChopThreshold;
+    _coolStepThreshold = coolStepThreshold;
+    ConfigStore::Config& config = _configStore.edit();
+    config.stealthChopThreshold = _stealthChopThreshold;
+    config.coolStepThreshold = _coolStepThreshold;
+    if (_initializationState == InitializationState::OK) {
+      _applyChopperMode();
+      _stepper_driver.flush();
+    }
+  }
+}
 
-  // don't use stall guard
-  _stepper_driver.setStallGuardThreshold(0);
+void Stepper::setCoolStepWindow(uint8_t min, uint8_t max) {
+  if (min > 15 || max > 15) {
+    LOGW(TAG, "CoolStep window unplausible!");
+    return;
+  }
+  LOGI(TAG, "CoolStep window: SEMIN %d, SEMAX %d", min, max);
+  // save if values differ from known
+  if (_coolStepMin != min || _coolStepMax != max) {
+    _coolStepMin = min;
+    _coolStepMax = max;
+    ConfigStore::Config& config = _configStore.edit();
+    config.coolStepMin = _coolStepMin;
+    config.coolStepMax = _coolStepMax;
+    if (_initializationState == InitializationState::OK && _motorState != MotorState::CHARACTERIZING) {
+      _applyChopperMode();
+      _stepper_driver.flush();
+    }
+  }
+}
 
-  // set the known values for gradient and offset
-  _stepper_driver.setPwmGradient(_pwmGradient);
-  _stepper_driver.setPwmOffset(_pwmOffset);
-  _stepper_driver.enableAutomaticCurrentScaling();
-  _stepper_driver.enableAutomaticGradientAdaptation();
+void Stepper::setCurrentSchedule(uint8_t acceleration, uint8_t cruise, uint8_t hold) {
+  if (acceleration == 0 || acceleration > CURRENT_BOOST_MAX_PERCENT || cruise == 0 || cruise > acceleration || hold > acceleration) {
+    LOGW(TAG, "Current schedule unplausible!");
+    return;
+  }
+  LOGI(TAG, "Current schedule: %d%% accelerating, %d%% at cruise, %d%% holding", acceleration, cruise, hold);
+  // save if values differ from known
+  if (_currentAcceleration != acceleration || _currentCruise != cruise || _currentHold != hold) {
+    _currentAcceleration = acceleration;
+    _currentCruise = cruise;
+    _currentHold = hold;
+    ConfigStore::Config& config = _configStore.edit();
+    config.currentAcceleration = _currentAcceleration;
+    config.currentCruise = _currentCruise;
+    config.currentHold = _currentHold;
+    if (_initializationState == InitializationState::OK) {
+      _applyCurrentSchedule();
+      _stepper_driver.flush();
+    }
+  }
+}
 
-  // software-enable TMC2209
-  _stepper_driver.enable();
-  // Hardware-disable the motor
-  digitalWrite(TMC_EN, HIGH);
-  _stepper->setAutoEnable(true);
+// IRUN and IHOLD within the sense range of the boost, cruise and derating are scaled from there ((CS + 1) / 32)
+// (VSENSE doesn't change while moving)
+void Stepper::_applyCurrentSchedule() {
+  _stepper_driver.setRMSCurrent(TMC_RMS_CURRENT * _currentAcceleration / 100, TMC_R_SENSE, static_cast<float>(_currentHold) * _thermalDerating / 100 / _currentAcceleration);
+  uint8_t boost = _stepper_driver.getRunCurrent();
+  _runCurrentBoost = _scaleCurrent(boost, _thermalDerating);
+  _runCurrentCruise = _scaleCurrent(boost, static_cast<uint32_t>(_currentCruise) * _thermalDerating / _currentAcceleration);
+  _stepper_driver.setRunCurrent(_cruiseCurrent ? _runCurrentCruise : _runCurrentBoost);
+}
 
-  // Final check of driver
-  if (_stepper_driver.isSetupAndCommunicating()) {
-    LOGI(TAG, "Stepper driver is setup and communicating!");
-    _initializationState = InitializationState::OK;
-    _driverComState = DriverComState::OK;
-    _motorState = MotorState::IDLE;
-    led.setMode(LED::LEDMode::IDLE);
+// the reduced current only while driving at a constant speed, anything else gets the boost
+void Stepper::_scheduleCurrent(bool cruise) {
+  if (cruise == _cruiseCurrent || _initializationState != InitializationState::OK)
+    return;
+  _cruiseCurrent = cruise;
+  _stepper_driver.setRunCurrent(cruise ? _runCurrentCruise : _runCurrentBoost);
+  _stepper_driver.flush();
+}
+
+// from the temperature flags of the last DRV_STATUS
+void Stepper::_checkThermal() {
+  TMC2209Driver::Status status = _stepper_driver.getStatus();
+  ThermalState state = ThermalState::NORMAL;
+  if (status.over_temperature_shutdown) {
+    state = ThermalState::SHUTDOWN;
+  } else if (status.over_temperature_150c || status.over_temperature_157c) {
+    state = ThermalState::CRITICAL;
+  } else if (status.over_temperature_143c) {
+    state = ThermalState::HOT;
+  } else if (status.over_temperature_120c || status.over_temperature_warning) {
+    state = ThermalState::WARM;
+  }
 
-    // execute callback (from website)
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = getMotorState_as_string().c_str();
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
+  if (state < _thermalState) {
+    if (_thermalCooling == 0) {
+      _thermalCooling = max(millis(), 1UL);
+      return;
     }
+    if (millis() - _thermalCooling < THERMAL_COOLDOWN_MS)
+      return;
+  }
+  _thermalCooling = 0;
+  if (state == _thermalState)
+    return;
+
+  bool shutdown = state == ThermalState::SHUTDOWN;
+  if (state > _thermalState) {
+    LOGW(TAG, "Thermal state: %s", getThermalState_as_string(state));
   } else {
-    LOGE(TAG, "Stepper driver setup failed!");
-    _stepper->setAutoEnable(false);
-    _initializationState = InitializationState::UNITITIALIZED;
-    _driverComState = DriverComState::ERROR;
-    _motorState = MotorState::ERROR;
-    led.setMode(LED::LEDMode::ERROR);
+    LOGI(TAG, "Thermal state: %s", getThermalState_as_string(state));
+  }
+  _thermalState = state;
+  switch (state) {
+    case ThermalState::WARM:
+      _thermalDerating = THERMAL_WARM_PERCENT;
+      break;
+    case ThermalState::HOT:
+      _thermalDerating = THERMAL_HOT_PERCENT;
+      break;
+    case ThermalState::CRITICAL:
+    case ThermalState::SHUTDOWN:
+      _thermalDerating = THERMAL_CRITICAL_PERCENT;
+      break;
+    default:
+      _thermalDerating = 100;
+      break;
+  }
+  if (_initializationState == InitializationState::OK) {
+    _applyCurrentSchedule();
+    _stepper_driver.flush();
+  }
 
-    // execute callback (from website)
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = getMotorState_as_string().c_str();
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
+  if (shutdown) {
+    // the driver stopped driving while the steps went on, the position is lost
+    if (_motorState == MotorState::DRIVING || _motorState == MotorState::HOMING || _motorState == MotorState::CHARACTERIZING)
+      halt_move();
+    _homed = false;
+    // send websock event
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = "Driver overheated, homing needed!";
+    eventBus.publish(event);
+  } else {
+    _applyThermalCaps();
   }
-}
 
-// final part of initialization
-void Stepper::_initTMC2209Finished() {
-  LOGD(TAG, "Final pwmAutoScale: %d", _stepper_driver.getPwmScaleAuto());
-  // Hardware-disable the motor
-  digitalWrite(TMC_EN, HIGH);
-  // Software-disable TMC2209
-  _stepper_driver.disable();
+  // send websock event
+  eventBus.publish(thermalEvent());
+}
 
-  // activate StealthChop
-  _stepper_driver.setStealthChopDurationThreshold(STEALTHCHOP_THRSH);
-  _stepper_driver.enableStealthChop();
+// a running move of the ramp generator is slowed down right away (jogging with the next refresh)
+void Stepper::_applyThermalCaps() {
+  if (_motorState != MotorState::DRIVING || _jogging || _planner.isActive() || !_stepper->isRunning() || (_microstepSwitch != MicrostepSwitch::NONE && _microstepSwitch != MicrostepSwitch::COARSE))
+    return;
+  int32_t speed = min(_limitSpeed(_requested_speed), _destination_speed);
+  int32_t acceleration = min(_passResonances(speed, _limitAcceleration(_requested_acceleration)), _destination_acceleration);
+  if (speed >= _destination_speed && acceleration >= _destination_acceleration)
+    return;
+  _destination_speed = speed;
+  _destination_acceleration = acceleration;
+  _stepper->setAcceleration(_destination_acceleration * _stepsPerMm());
+  _stepper->setSpeedInMilliHz(_destination_speed * _stepsPerMm() * 1000);
+  _stepper->applySpeedAcceleration();
+}
 
-  // deactivate CoolStep
-  _stepper_driver.setCoolStepDurationThreshold(STEALTHCHOP_THRSH + 1);
-  _stepper_driver.disableCoolStep();
+MotorEvent Stepper::thermalEvent() {
+  MotorEvent event = {};
+  event.type = MotorEvent::Type::THERMAL;
+  event.origin = -1;
+  event.thermal = {static_cast<uint8_t>(_thermalState), _thermalDerating, _speedCap(), _accelerationCap()};
+  return event;
+}
 
-  // set power saving standstill mode
-  _stepper_driver.setStandstillMode(TMC2209::StandstillMode::BRAKING);
+void Stepper::setResonanceMap(uint64_t resonanceMap) {
+  LOGI(TAG, "Resonance map: 0x%016llx", resonanceMap);
+  // save if values differ from known
+  if (_resonanceMap != resonanceMap) {
+    _resonanceMap = resonanceMap;
+    _configStore.edit().resonanceMap = _resonanceMap;
+  }
+}
 
-  // software-enable TMC2209
-  _stepper_driver.enable();
-  _stepper->setAutoEnable(true);
+bool Stepper::getStallPolicy_from_string(const char* name, StallPolicy* policy) {
+  for (const auto& entry : StallPolicy_string_map) {
+    if (entry.second == name) {
+      *policy = entry.first;
+      return true;
+    }
+  }
+  return false;
+}
 
-  // Final check of driver
-  if (_stepper_driver.isSetupAndCommunicating()) {
-    LOGI(TAG, "Stepper driver is setup and communicating!");
-    _initializationState = InitializationState::OK;
-    _driverComState = DriverComState::OK;
-    _motorState = MotorState::IDLE;
-    led.setMode(LED::LEDMode::IDLE);
-  } else {
-    LOGE(TAG, "Stepper driver setup failed!");
-    _stepper->setAutoEnable(false);
-    _initializationState = InitializationState::UNITITIALIZED;
-    _driverComState = DriverComState::ERROR;
-    _motorState = MotorState::ERROR;
-    led.setMode(LED::LEDMode::ERROR);
+void Stepper::setStallPolicy(StallPolicy policy) {
+  LOGI(TAG, "Stall policy: %s", getStallPolicy_as_string(policy));
+  // save if value differs from known
+  if (_stallPolicy != policy) {
+    _stallPolicy = policy;
+    _configStore.edit().stallPolicy = static_cast<uint8_t>(_stallPolicy);
+  }
+}
 
-    // execute callback (from website)
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = getMotorState_as_string().c_str();
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
+bool Stepper::getShaper_from_string(const char* name, MotionPlanner::Shaper* shaper) {
+  for (const auto& entry : Shaper_string_map) {
+    if (entry.second == name) {
+      *shaper = entry.first;
+      return true;
     }
+  }
+  return false;
+}
 
-    // bail out, the check-Task might be able to recover from this mess!
+void Stepper::setShaper(MotionPlanner::Shaper shaper, float frequency, float damping) {
+  if (frequency <= 0 || damping < 0 || damping >= 1) {
+    LOGW(TAG, "Shaper parameters unplausible!");
     return;
   }
+  LOGI(TAG, "Shaper: %s at %.1f Hz (damping: %.3f)", getShaper_as_string(shaper), frequency, damping);
+  // save if values differ from known
+  if (_shaper != shaper || _shaperFrequency != frequency || _shaperDamping != damping) {
+    _shaper = shaper;
+    _shaperFrequency = frequency;
+    _shaperDamping = damping;
+    ConfigStore::Config& config = _configStore.edit();
+    config.shaper = static_cast<uint8_t>(_shaper);
+    config.shaperFrequency = _shaperFrequency;
+    config.shaperDamping = _shaperDamping;
+    if (!_shaperCalibration.active)
+      _planner.setShaper(_shaper, _shaperFrequency, _shaperDamping);
+  }
+}
 
-  // possibly do power-on homing
-  if (!_homed && _autoHome) {
-    do_homing();
+// TSTEP counts the driver's clock between 1/256 µSteps
+uint32_t Stepper::_speedToTstep(int32_t speed) {
+  return TMC_CLOCK / (static_cast<uint32_t>(speed) * STEPS_PER_MM * (256 / USTEPS_PER_STEP));
+}
+
+// StealthChop at low speeds (CoolStep in the upper part of it), SpreadCycle above
+void Stepper::_applyChopperMode() {
+  switch (_chopperMode) {
+    case ChopperMode::QUIET:
+      _stepper_driver.enableStealthChop();
+      _stepper_driver.setStealthChopDurationThreshold(0);
+      break;
+    case ChopperMode::TORQUE:
+      _stepper_driver.disableStealthChop();
+      _stepper_driver.setStealthChopDurationThreshold(_stealthChopThreshold);
+      break;
+    default:
+      _stepper_driver.enableStealthChop();
+      _stepper_driver.setStealthChopDurationThreshold(_stealthChopThreshold);
+      break;
+  }
+  if (_chopperMode != ChopperMode::TORQUE && _coolStepThreshold > 0 && _coolStepMin > 0) {
+    _stepper_driver.setCoolStepDurationThreshold(_coolStepThreshold);
+    _stepper_driver.enableCoolStep(_coolStepMin, _coolStepMax);
   } else {
-    // execute callback (from website)
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = getMotorState_as_string().c_str();
-      jsonMsg["move_state"]["position"] = 0;
-      jsonMsg["move_state"]["speed"] = 0;
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
+    _stepper_driver.setCoolStepDurationThreshold(0);
+    _stepper_driver.disableCoolStep();
   }
 }
 
-// gradient calibration callback
-void Stepper::_checkTMC2209Gradient() {
-  int16_t pwmAutoScale = _stepper_driver.getPwmScaleAuto();
-  LOGD(TAG, "Check pwmAutoScale: %d", pwmAutoScale);
-  if (abs(pwmAutoScale) < 10) {
-    _initTMC2209Finished();
-    // Remember values to skip initialization on power loss
-    _pwmGradient = _stepper_driver.getPwmGradientAuto();
-    _pwmOffset = _stepper_driver.getPwmOffsetAuto();
-  } else {
-    // Try again in half a second
-    Task* optimizeGradientTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _initTMC2209Gradient(); }, _scheduler, false, NULL, NULL, true);
-    optimizeGradientTask->enableDelayed(500);
+// switching is only done at standstill (StealthChop needs to regulate from there)
+void Stepper::_selectChopperMode(ChopperMode mode) {
+  _chopperModeRestore = false;
+  if (mode == _chopperMode)
+    return;
+  if (_stepper->isRunning()) {
+    LOGD(TAG, "Chopper mode kept while moving");
+    return;
   }
+  LOGD(TAG, "Chopper mode: %s", ChopperMode_string_map[mode].c_str());
+  _chopperMode = mode;
+  _applyChopperMode();
+  _stepper_driver.flush();
 }
 
-// gradient calibration callback
-void Stepper::_initTMC2209Gradient(bool startAdaptation) {
-  // set movement speed to 250 rpm
-  _stepper->setSpeedInMilliHz(HOMING_SPEED);
+// the limits are lowered by the thermal derating, 0 without a limit
+int32_t Stepper::_speedCap() {
+  if (_thermalDerating >= 100 || _maxSpeed <= 0)
+    return _maxSpeed;
+  return std::max<int32_t>(_maxSpeed * (100 + _thermalDerating) / 200, 1);
+}
 
-  // set acceleration
-  _stepper->setAcceleration(HOMING_ACCELERATION);
+int32_t Stepper::_accelerationCap() {
+  if (_thermalDerating >= 100 || _maxAcceleration <= 0)
+    return _maxAcceleration;
+  return std::max<int32_t>(_maxAcceleration * _thermalDerating / 100, 1);
+}
 
-  // we're at the homing button, move 3 mm away from home
-  if ((_initializationState == InitializationState::GRADIENT_HOME) || !digitalRead(TMC_HOME)) {
-    _movementDirection = MotorDirection::FORWARDS;
-    _initializationState = InitializationState::GRADIENT_DEHOMING;
-    _stepper->move(3 * STEPS_PER_MM);
-    // Wait for 500 ms and check result
-    Task* optimizeGradientDeHomingTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _checkTMC2209Gradient(); }, _scheduler, false, NULL, NULL, true);
-    optimizeGradientDeHomingTask->enableDelayed(500);
-  } else { // just move 2 mm towards home
-    _movementDirection = MotorDirection::BACKWARDS;
-    _initializationState = InitializationState::GRADIENT_HOMING;
-    _stepper->move(-2 * STEPS_PER_MM);
-    // Wait for 500 ms and check result
-    Task* optimizeGradientHomingTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _checkTMC2209Gradient(); }, _scheduler, false, NULL, NULL, true);
-    optimizeGradientHomingTask->enableDelayed(500);
+// the commanded speed is derated as well (moves below the caps would not be slowed down otherwise)
+int32_t Stepper::_limitSpeed(int32_t speed) {
+  if (_thermalDerating < 100 && speed > 0)
+    speed = std::max<int32_t>(speed * (100 + _thermalDerating) / 200, 1);
+  int32_t maxSpeed = _speedCap();
+  if (maxSpeed > 0 && speed > maxSpeed) {
+    LOGD(TAG, "Speed limited to %d mm/s", maxSpeed);
+    speed = maxSpeed;
   }
+  // below the lower edge of resonant bins (unless there's no speed left)
+  int32_t stable = speed;
+  while (stable > 0 && (_resonanceMap >> _resonanceBin(stable)) & 1)
+    stable = _resonanceBin(stable) * RESONANCE_SPEED_STEP - RESONANCE_SPEED_STEP / 2 - 1;
+  if (stable > 0 && stable != speed) {
+    LOGD(TAG, "Speed lowered to %d mm/s (resonance)", stable);
+    return stable;
+  }
+  return speed;
+}
 
-  // start adaptation if requested (not running yet)
-  if (startAdaptation) {
-    LOGD(TAG, "Starting pwmAutoScale: %d", _stepper_driver.getPwmScaleAuto());
-    _stepper_driver.enableAutomaticGradientAdaptation();
+int32_t Stepper::_limitAcceleration(int32_t acceleration) {
+  if (_thermalDerating < 100 && acceleration > 0)
+    acceleration = std::max<int32_t>(acceleration * _thermalDerating / 100, 1);
+  int32_t maxAcceleration = _accelerationCap();
+  if (maxAcceleration > 0 && acceleration > maxAcceleration) {
+    LOGD(TAG, "Acceleration limited to %d mm/ss", maxAcceleration);
+    return maxAcceleration;
   }
+  return acceleration;
 }
 
-// Initial part of initialization
+// resonant bins below the cruise speed are passed as fast as characterized (a ramp has a single acceleration)
+int32_t Stepper::_passResonances(int32_t speed, int32_t acceleration) {
+  uint8_t bin = _resonanceBin(speed);
+  int32_t maxAcceleration = _maxAcceleration > 0 ? _accelerationCap() : 0;
+  if (maxAcceleration > acceleration && (_resonanceMap & ((1ULL << bin) - 1)) != 0) {
+    LOGD(TAG, "Acceleration raised to %d mm/ss (resonance)", maxAcceleration);
+    return maxAcceleration;
+  }
+  return acceleration;
+}
+
+void Stepper::setHomingMode(HomingMode mode, uint8_t stallThreshold) {
+  LOGI(TAG, "Homing mode: %s (stall threshold: %d)", getHomingMode_as_string(mode), stallThreshold);
+  // save if values differ from known
+  if (_homingMode != mode || _stallThreshold != stallThreshold) {
+    _homingMode = mode;
+    _stallThreshold = stallThreshold;
+    ConfigStore::Config& config = _configStore.edit();
+    config.homingMode = static_cast<uint8_t>(_homingMode);
+    config.stallThreshold = _stallThreshold;
+  }
+}
+
+void Stepper::setStrokeLength(int32_t strokeLength) {
+  if (strokeLength < 0) {
+    LOGW(TAG, "Stroke length unplausible!");
+    return;
+  }
+  LOGI(TAG, "Stroke length: %d mm", strokeLength);
+  // save if value differs from known
+  if (_strokeLength != strokeLength) {
+    _strokeLength = strokeLength;
+    _configStore.edit().strokeLength = _strokeLength;
+  }
+}
+
+// holding current at standstill, or power saving (braking and hardware-disabled)
+void Stepper::_applyStandstillMode() {
+  if (_holdPosition) {
+    _stepper_driver.setStandstillMode(TMC2209Driver::StandstillMode::NORMAL);
+    _stepper->setAutoEnable(false);
+    _stepper->enableOutputs();
+  } else {
+    _stepper_driver.setStandstillMode(TMC2209Driver::StandstillMode::BRAKING);
+    _stepper->setAutoEnable(true);
+  }
+  _stepper_driver.flush();
+}
+
+uint32_t Stepper::_positionRecordCRC(const PositionRecord& record) {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&record), offsetof(PositionRecord, crc));
+}
+
+// called at standstill, the journal is written behind when it differs
+void Stepper::_recordPosition() {
+  PositionRecord record = {};
+  record.magic = PositionRecord::MAGIC;
+  record.position = _currentPosition();
+  record.microstepCounter = _stepper_driver.getMicrostepCounter();
+  record.homed = _homed;
+  record.holding = _holdPosition && !digitalRead(TMC_EN);
+  record.standstill = true;
+  record.crc = _positionRecordCRC(record);
+  rtcPositionRecord = record;
+  _configStore.setJournal(record);
+}
+
+// called when starting to move, a reset until the next standstill loses the position
+void Stepper::_invalidatePosition() {
+  if (rtcPositionRecord.standstill) {
+    rtcPositionRecord.standstill = false;
+    rtcPositionRecord.crc = _positionRecordCRC(rtcPositionRecord);
+  }
+  if (_configStore.getJournal().standstill) {
+    PositionRecord journal = _configStore.getJournal();
+    journal.standstill = false;
+    journal.crc = _positionRecordCRC(journal);
+    _configStore.setJournal(journal);
+  }
+}
+
+// Check the retained position against the driver (after a restart or power loss of the driver)
+// It's only valid when the driver wasn't reset and the motor was held without any step since
+void Stepper::_restorePosition() {
+  const PositionRecord* record = &rtcPositionRecord;
+  if (record->magic != PositionRecord::MAGIC || record->crc != _positionRecordCRC(*record))
+    record = &_configStore.getJournal();
+  bool recorded = record->magic == PositionRecord::MAGIC && record->crc == _positionRecordCRC(*record) && record->homed;
+
+  const char* reason = nullptr;
+  TMC2209Driver::GlobalStatus globalStatus = _stepper_driver.getGlobalStatus();
+  uint16_t microstepCounter = _stepper_driver.getMicrostepCounter();
+  if (!recorded) {
+    reason = "not recorded";
+  } else if (!record->standstill) {
+    reason = "moved";
+  } else if (!record->holding) {
+    reason = "not holding";
+  } else if (globalStatus.reset) {
+    reason = "driver reset";
+  } else if (record->microstepCounter != microstepCounter) {
+    reason = "MSCNT changed";
+  }
+
+  // detect the next reset of the driver
+  _stepper_driver.clearReset();
+
+  if (reason == nullptr) {
+    if (!_homed) {
+      LOGI(TAG, "Restored position: %d µSteps", record->position);
+      _stepper->setCurrentPosition(record->position);
+      _homed = true;
+      _destination_position = record->position / STEPS_PER_MM;
+    }
+  } else if (recorded || _homed) {
+    // refuse the position, homing is required
+    LOGW(TAG, "Retained position is invalid (%s)", reason);
+    _homed = false;
+    rtcPositionRecord = {};
+    _configStore.setJournal({});
+
+    // send websock event
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = "Position lost, homing required!";
+    eventBus.publish(event);
+  }
+}
+
+// hash of everything the PWM calibration depends on (FNV-1a)
+uint32_t Stepper::_pwmConfigHash() {
+  const uint32_t config[] = {1, USTEPS_PER_STEP, TMC_RMS_CURRENT, static_cast<uint32_t>(TMC_R_SENSE * 1000)};
+  uint32_t hash = 2166136261;
+  for (uint32_t value : config) {
+    for (int i = 0; i < 4; i++) {
+      hash ^= (value >> (8 * i)) & 0xFF;
+      hash *= 16777619;
+    }
+  }
+  return hash;
+}
+
+void Stepper::_savePwmCalibration() {
+  LOGI(TAG, "Saving PWM calibration (gradient: %d, offset: %d)", _pwmGradient, _pwmOffset);
+  ConfigStore::Config& config = _configStore.edit();
+  config.pwmGradient = _pwmGradient;
+  config.pwmOffset = _pwmOffset;
+  config.pwmHash = _pwmConfigHash();
+  _pwmCalibrated = true;
+}
+
+void Stepper::calibrate() {
+  LOGI(TAG, "PWM calibration requested");
+  _configStore.edit().pwmHash = 0;
+  _pwmCalibrated = false;
+  _initTMC2209();
+}
+
+void Stepper::characterize() {
+  LOGI(TAG, "Characterizing speed and acceleration limits");
+  _startCharacterization(CharacterizationMode::LIMITS);
+}
+
+void Stepper::tuneChopper() {
+  LOGI(TAG, "Tuning chopper thresholds");
+  _startCharacterization(CharacterizationMode::CHOPPER);
+}
+
+void Stepper::mapResonances() {
+  LOGI(TAG, "Mapping resonances");
+  _startCharacterization(CharacterizationMode::RESONANCES);
+}
+
+// the test moves run along the stroke, lost steps are detected at the home switch
+bool Stepper::_canTestAlongStroke(CharacterizationMode mode) {
+  static const char* const needsSwitch[] = {"Characterization needs the home switch!", "Chopper tuning needs the home switch!", "Resonance mapping needs the home switch!"};
+  static const char* const needsStroke[] = {"Characterization needs the stroke length!", "Chopper tuning needs the stroke length!", "Resonance mapping needs the stroke length!"};
+  static const char* const notAllowed[] = {"Characterization not allowed!", "Chopper tuning not allowed!", "Resonance mapping not allowed!"};
+  uint8_t index = static_cast<uint8_t>(mode);
+  const char* warning = nullptr;
+  if (_homingMode != HomingMode::SWITCH) {
+    warning = needsSwitch[index];
+  } else if (_strokeLength <= 0) {
+    warning = needsStroke[index];
+  } else if (_motorState != MotorState::IDLE || _stepper->isRunning()) {
+    warning = notAllowed[index];
+  }
+  if (warning == nullptr)
+    return true;
+
+  LOGW(TAG, "%s", warning);
+  // send websock event
+  MotorEvent event = _motorStateEvent(MotorState::WARNING);
+  event.warning = warning;
+  eventBus.publish(event);
+  return false;
+}
+
+// all of them run test moves at increasing speeds
+void Stepper::_startCharacterization(CharacterizationMode mode) {
+  _characterization = {};
+  _characterization.phase = Characterization::REFERENCE;
+  _characterization.mode = mode;
+  switch (mode) {
+    case CharacterizationMode::CHOPPER:
+      _characterization.speed = CHOPPER_TUNE_SPEED_START;
+      _characterization.acceleration = CHARACTERIZE_ACCELERATION_START;
+      break;
+    case CharacterizationMode::RESONANCES:
+      // quickly through the bins below for a long cruise
+      _characterization.speed = RESONANCE_SPEED_STEP;
+      _characterization.acceleration = _maxAcceleration > 0 ? _maxAcceleration : CHARACTERIZE_ACCELERATION_START;
+      break;
+    default:
+      _characterization.speed = CHARACTERIZE_SPEED_START;
+      _characterization.acceleration = CHARACTERIZE_ACCELERATION_START;
+      break;
+  }
+  _characterization.distance = _strokeLength;
+  _motorState = MotorState::CHARACTERIZING;
+  _setLEDMode(LED::LEDMode::DRIVING);
+
+  // send websock event
+  eventBus.publish(_motorStateEvent(_motorState));
+
+  // StallGuard is valid in StealthChop above TCOOLTHRS (measured at full current, tuning and mapping stay in StealthChop)
+  _selectChopperMode(mode == CharacterizationMode::LIMITS ? ChopperMode::AUTO : ChopperMode::QUIET);
+  _stepper_driver.setCoolStepDurationThreshold(0xFFFFF);
+  _stepper_driver.disableCoolStep();
+  _stepper_driver.flush();
+
+  // home first, lost steps are found at the switch after each test
+  _startSwitchHoming();
+  _characterizeTask->enable();
+}
+
+void Stepper::_characterizeCallback() {
+  switch (_characterization.phase) {
+    case Characterization::REFERENCE:
+      if (_switchHoming == SwitchHoming::NONE && !_stepper->isRunning())
+        _characterizeTestMove(_characterization.speed, _characterization.acceleration);
+      break;
+
+    case Characterization::TEST_OUT:
+    case Characterization::TEST_BACK:
+      if (_stepper->isRunning()) {
+        // sample the load (one batch at a time)
+        if (!_characterization.sampling) {
+          _characterization.sampling = true;
+          _stepper_driver.refresh(TMC2209Driver::REFRESH_LOAD | TMC2209Driver::REFRESH_PWM | TMC2209Driver::REFRESH_DRIVER_STATUS, [&](bool ok) {
+            _characterization.sampling = false;
+            if (ok)
+              _characterizeSample();
+          });
+        }
+      } else if (_characterization.phase == Characterization::TEST_OUT) {
+        // move back to just before home with the same values
+        _characterization.phase = Characterization::TEST_BACK;
+        _movementDirection = MotorDirection::BACKWARDS;
+        _stepper->moveTo(HOMING_CREEP_MM * STEPS_PER_MM);
+      } else {
+        _characterization.phase = Characterization::VERIFY;
+        _homeDeviation = 0;
+        _startSwitchHoming();
+      }
+      break;
+
+    case Characterization::VERIFY:
+      if (_switchHoming == SwitchHoming::NONE && !_stepper->isRunning())
+        _characterizeEvaluate();
+      break;
+
+    default:
+      break;
+  }
+}
+
+// load while moving, StallGuard and PWM_SCALE are only meaningful in StealthChop
+void Stepper::_characterizeSample() {
+  if (!_stepper_driver.getStatus().stealth_chop_mode)
+    return;
+  _characterization.maxPwmScaleSum = max(_characterization.maxPwmScaleSum, _stepper_driver.getPwmScaleSum());
+  // StallGuard needs some velocity
+  if (static_cast<uint32_t>(abs(_stepper->getCurrentSpeedInMilliHz())) >= static_cast<uint32_t>(_characterization.speed) * STEPS_PER_MM * 1000 / 2)
+    _characterization.minStallGuard = min(_characterization.minStallGuard, _stepper_driver.getStallGuardResult());
+  if ((_stepper->rampState() & RAMP_STATE_MASK) == RAMP_STATE_COAST) {
+    uint16_t stallGuard = _stepper_driver.getStallGuardResult();
+    _characterization.stallGuardSum += stallGuard;
+    _characterization.stallGuardSquareSum += static_cast<uint32_t>(stallGuard) * stallGuard;
+    _characterization.pwmScaleSumSum += _stepper_driver.getPwmScaleSum();
+    _characterization.stallGuardSamples++;
+  }
+}
+
+void Stepper::_characterizeTestMove(int32_t speed, int32_t acceleration) {
+  LOGI(TAG, "Testing %d mm/s at %d mm/ss", speed, acceleration);
+  _characterization.phase = Characterization::TEST_OUT;
+  _characterization.minStallGuard = UINT16_MAX;
+  _characterization.maxPwmScaleSum = 0;
+  _characterization.stallGuardSum = 0;
+  _characterization.stallGuardSquareSum = 0;
+  _characterization.pwmScaleSumSum = 0;
+  _characterization.stallGuardSamples = 0;
+  _characterization.switchHit = false;
+  // tuning and mapping only need a short cruise (half a second)
+  int32_t distance = _characterization.distance;
+  if (_characterization.mode != CharacterizationMode::LIMITS)
+    distance = min(distance, max(static_cast<int32_t>(10), speed / 2 + speed * speed / acceleration));
+  _movementDirection = MotorDirection::FORWARDS;
+  _stepper->setAcceleration(acceleration * STEPS_PER_MM);
+  _stepper->setSpeedInMilliHz(speed * STEPS_PER_MM * 1000);
+  _stepper->moveTo(distance * STEPS_PER_MM);
+}
+
+void Stepper::_characterizeEvaluate() {
+  // lost steps, no voltage headroom left or close to stalling (the threshold of sensorless homing)
+  bool stepLoss = _characterization.switchHit || abs(_homeDeviation) > CHARACTERIZE_STEP_LOSS;
+  bool overload = _characterization.maxPwmScaleSum == 255 || (_characterization.minStallGuard != UINT16_MAX && _characterization.minStallGuard < 2 * _stallThreshold);
+  LOGI(TAG, "Test %s (deviation: %d µSteps, min SG_RESULT: %d, max PWM_SCALE_SUM: %d)", (stepLoss || overload) ? "failed" : "passed", _homeDeviation, _characterization.minStallGuard, _characterization.maxPwmScaleSum);
+  switch (_characterization.mode) {
+    case CharacterizationMode::CHOPPER:
+      // StallGuard is low at low speeds anyway
+      _chopperTuneNext(!stepLoss && _characterization.maxPwmScaleSum < CHOPPER_PWM_LIMIT);
+      break;
+    case CharacterizationMode::RESONANCES:
+      _resonanceNext(stepLoss);
+      break;
+    default:
+      _characterizeNext(!stepLoss && !overload);
+      break;
+  }
+}
+
+void Stepper::_characterizeNext(bool passed) {
+  if (!_characterization.accelerationSweep) {
+    if (passed) {
+      _characterization.bestSpeed = _characterization.speed;
+      _characterization.speed = _characterization.speed * 5 / 4;
+      // the speed must be reached within the distance (accelerating and decelerating)
+      if (_characterization.speed <= CHARACTERIZE_SPEED_MAX && _characterization.speed * _characterization.speed / _characterization.acceleration <= _characterization.distance) {
+        _characterizeTestMove(_characterization.speed, _characterization.acceleration);
+        return;
+      }
+    }
+    if (_characterization.bestSpeed == 0) {
+      _characterizeFinish("Characterization failed!");
+      return;
+    }
+    // continue with the acceleration at the highest speed (passed at the lowest acceleration)
+    _characterization.accelerationSweep = true;
+    passed = true;
+  }
+
+  if (passed) {
+    _characterization.bestAcceleration = _characterization.acceleration;
+    _characterization.acceleration = _characterization.acceleration * 3 / 2;
+    if (_characterization.acceleration <= CHARACTERIZE_ACCELERATION_MAX) {
+      _characterizeTestMove(_characterization.bestSpeed, _characterization.acceleration);
+      return;
+    }
+  }
+  _characterizeFinish(nullptr);
+}
+
+// StealthChop up to the highest speed with headroom, CoolStep from the speed where StallGuard exceeds its window
+void Stepper::_chopperTuneNext(bool passed) {
+  if (passed) {
+    uint16_t stallGuard = _characterization.stallGuardSamples > 0 ? _characterization.stallGuardSum / _characterization.stallGuardSamples : 0;
+    _characterization.stealthChopSpeed = _characterization.speed;
+    if (_characterization.coolStepSpeed == 0 && stallGuard >= (_coolStepMin + _coolStepMax + 1) * 32) {
+      _characterization.coolStepSpeed = _characterization.speed;
+      _characterization.coolStepStallGuard = stallGuard;
+    }
+    int32_t maxSpeed = _maxSpeed > 0 ? _maxSpeed : CHARACTERIZE_SPEED_MAX;
+    _characterization.speed = _characterization.speed * 5 / 4;
+    // the speed must be reached within the distance (accelerating and decelerating)
+    if (_characterization.speed <= maxSpeed && _characterization.speed * _characterization.speed / _characterization.acceleration <= _characterization.distance) {
+      _characterizeTestMove(_characterization.speed, _characterization.acceleration);
+      return;
+    }
+  }
+  _characterizeFinish(_characterization.stealthChopSpeed == 0 ? "Chopper tuning failed!" : nullptr);
+}
+
+// one bin after the other while StealthChop has headroom (neither value is meaningful in SpreadCycle)
+void Stepper::_resonanceNext(bool stepLoss) {
+  ResonanceSample sample = {};
+  uint16_t samples = _characterization.stallGuardSamples;
+  if (samples > 0) {
+    uint32_t mean = _characterization.stallGuardSum / samples;
+    uint32_t meanSquare = _characterization.stallGuardSquareSum / samples;
+    sample.stallGuardMean = mean;
+    sample.stallGuardDeviation = meanSquare > mean * mean ? lroundf(sqrtf(meanSquare - mean * mean)) : 0;
+    sample.pwmScaleSumMean = _characterization.pwmScaleSumSum / samples;
+  }
+  sample.stepLoss = stepLoss;
+  LOGD(TAG, "%d mm/s: SG_RESULT %d ± %d, PWM_SCALE_SUM %d (%d samples)", _characterization.speed, sample.stallGuardMean, sample.stallGuardDeviation, sample.pwmScaleSumMean, samples);
+  _characterization.resonances.push_back(sample);
+
+  int32_t maxSpeed = _maxSpeed > 0 ? _maxSpeed : CHARACTERIZE_SPEED_MAX;
+  _characterization.speed += RESONANCE_SPEED_STEP;
+  // the speed must be reached within the distance (accelerating and decelerating)
+  if (_characterization.maxPwmScaleSum < CHOPPER_PWM_LIMIT && _characterization.resonances.size() < RESONANCE_BINS - 1 && _characterization.speed <= maxSpeed &&
+      _characterization.speed * _characterization.speed / _characterization.acceleration <= _characterization.distance) {
+    _characterizeTestMove(_characterization.speed, _characterization.acceleration);
+    return;
+  }
+  _characterizeFinish(_characterization.resonances.empty() ? "Resonance mapping failed!" : nullptr);
+}
+
+// lost steps, a fluctuating load or a peak of the voltage needed at cruise
+uint64_t Stepper::_resonanceEvaluate() {
+  const std::vector<ResonanceSample>& resonances = _characterization.resonances;
+  uint64_t resonanceMap = 0;
+  for (size_t i = 0; i < resonances.size(); i++) {
+    const ResonanceSample& sample = resonances[i];
+    bool fluctuating = sample.stallGuardDeviation * 100 > sample.stallGuardMean * RESONANCE_SG_VARIATION;
+    bool peaking = i > 0 && i + 1 < resonances.size() && sample.pwmScaleSumMean > (resonances[i - 1].pwmScaleSumMean + resonances[i + 1].pwmScaleSumMean) / 2 + RESONANCE_PWM_PEAK;
+    if (sample.stepLoss || fluctuating || peaking) {
+      LOGI(TAG, "Resonance at %d mm/s", (i + 1) * RESONANCE_SPEED_STEP);
+      resonanceMap |= 1ULL << (i + 1);
+    }
+  }
+  return resonanceMap;
+}
+
+// back to the thresholds of regular operation
+void Stepper::_characterizeEnd() {
+  _characterization.phase = Characterization::NONE;
+  _characterizeTask->disable();
+  _chopperMode = ChopperMode::AUTO;
+  _applyChopperMode();
+  _stepper_driver.flush();
+}
+
+void Stepper::_characterizeFinish(const char* warning) {
+  _characterizeEnd();
+  _motorState = MotorState::IDLE;
+  _movementDirection = MotorDirection::STANDSTILL;
+  _setLEDMode(LED::LEDMode::IDLE);
+
+  if (warning != nullptr) {
+    LOGW(TAG, "%s", warning);
+    // send websock event
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = warning;
+    eventBus.publish(event);
+  } else if (_characterization.mode == CharacterizationMode::RESONANCES) {
+    setResonanceMap(_resonanceEvaluate());
+    // send websock event
+    eventBus.publish(configEvent());
+  } else if (_characterization.mode == CharacterizationMode::CHOPPER) {
+    LOGI(TAG, "StealthChop up to %d mm/s, CoolStep from %d mm/s", _characterization.stealthChopSpeed, _characterization.coolStepSpeed);
+    // CoolStep only works in StealthChop (TCOOLTHRS >= TSTEP > TPWMTHRS)
+    uint32_t stealthChopThreshold = _speedToTstep(_characterization.stealthChopSpeed);
+    uint32_t coolStepThreshold = _characterization.coolStepSpeed > 0 && _characterization.coolStepSpeed < _characterization.stealthChopSpeed ? _speedToTstep(_characterization.coolStepSpeed) : 0;
+    setChopperThresholds(stealthChopThreshold, coolStepThreshold);
+    // CoolStep raises the current below half of the unloaded SG_RESULT and lowers it above three quarters
+    if (coolStepThreshold > 0) {
+      uint8_t min = constrain(_characterization.coolStepStallGuard / 64, 1, 15);
+      setCoolStepWindow(min, constrain(_characterization.coolStepStallGuard * 3 / 128 - min - 1, 0, 15));
+    }
+    // send websock event
+    eventBus.publish(configEvent());
+  } else {
+    LOGI(TAG, "Highest reliable speed: %d mm/s, acceleration: %d mm/ss", _characterization.bestSpeed, _characterization.bestAcceleration);
+    setLimits(_characterization.bestSpeed * CHARACTERIZE_MARGIN / 100, _characterization.bestAcceleration * CHARACTERIZE_MARGIN / 100);
+    // send websock event
+    eventBus.publish(configEvent());
+  }
+
+  // send websock event
+  MotorEvent event = _motorStateEvent(_motorState);
+  event.setMoveState(getCurrentPosition(), 0, _telemetryCurrentScale);
+  eventBus.publish(event);
+}
+
+void Stepper::calibrateShaper() {
+  LOGI(TAG, "Calibrating the input shaper");
+  _shaperCalibration = {};
+  _shaperCalibration.active = true;
+  _shaperCalibration.position = _stepper->getCurrentPosition();
+  _shaperCalibration.frequency = SHAPER_CALIBRATE_FREQUENCY_MIN;
+  _motorState = MotorState::CHARACTERIZING;
+  _setLEDMode(LED::LEDMode::DRIVING);
+
+  // send websock event
+  eventBus.publish(_motorStateEvent(_motorState));
+
+  // StallGuard is valid in StealthChop above TCOOLTHRS, the oscillation itself isn't shaped
+  _selectChopperMode(ChopperMode::QUIET);
+  _stepper_driver.setCoolStepDurationThreshold(0xFFFFF);
+  _stepper_driver.disableCoolStep();
+  _stepper_driver.flush();
+  _planner.setShaper(MotionPlanner::Shaper::NONE, 0, 0);
+
+  _shaperCalibrateTask->enable();
+  _shaperTestMove();
+}
+
+// oscillate away from the start, accelerating for a quarter of the period and decelerating for another
+void Stepper::_shaperTestMove() {
+  float frequency = _shaperCalibration.frequency;
+  int32_t stroke = lroundf(SHAPER_CALIBRATE_ACCELERATION * STEPS_PER_MM / (16 * frequency * frequency));
+  uint32_t speed = SHAPER_CALIBRATE_ACCELERATION * STEPS_PER_MM / (2 * frequency);
+  _shaperCalibration.stallGuardSum = 0;
+  _shaperCalibration.stallGuardSamples = 0;
+
+  std::vector<MotionPlanner::Waypoint> path;
+  path.reserve(2 * SHAPER_CALIBRATE_CYCLES);
+  for (uint16_t i = 0; i < 2 * SHAPER_CALIBRATE_CYCLES; i++) {
+    path.push_back({_shaperCalibration.position + (i % 2 == 0 ? stroke : 0), speed, SHAPER_CALIBRATE_ACCELERATION * STEPS_PER_MM});
+  }
+  LOGD(TAG, "Oscillating at %d Hz (stroke: %d µSteps)", _shaperCalibration.frequency, stroke);
+  if (stroke < USTEPS_PER_STEP || !_startPlanner(path, 0))
+    _shaperCalibrateFinish("Shaper calibration failed!");
+}
+
+void Stepper::_shaperCalibrateCallback() {
+  if (_stepper->isRunning() || _planner.isActive()) {
+    // sample the load (one batch at a time)
+    if (!_shaperCalibration.sampling) {
+      _shaperCalibration.sampling = true;
+      _stepper_driver.refresh(TMC2209Driver::REFRESH_LOAD, [&](bool ok) {
+        _shaperCalibration.sampling = false;
+        if (ok && _stepper->isRunning()) {
+          _shaperCalibration.stallGuardSum += _stepper_driver.getStallGuardResult();
+          _shaperCalibration.stallGuardSamples++;
+        }
+      });
+    }
+    return;
+  }
+  if (_shaperCalibration.sampling)
+    return;
+
+  if (_shaperCalibration.stallGuardSamples == 0) {
+    _shaperCalibrateFinish("Shaper calibration failed!");
+    return;
+  }
+  _shaperCalibration.response.push_back(_shaperCalibration.stallGuardSum / _shaperCalibration.stallGuardSamples);
+  LOGD(TAG, "Mean SG_RESULT at %d Hz: %d", _shaperCalibration.frequency, _shaperCalibration.response.back());
+
+  _shaperCalibration.frequency += SHAPER_CALIBRATE_FREQUENCY_STEP;
+  if (_shaperCalibration.frequency > SHAPER_CALIBRATE_FREQUENCY_MAX) {
+    _shaperCalibrateFinish(nullptr);
+  } else {
+    _shaperTestMove();
+  }
+}
+
+// back to the shaper and the thresholds of regular operation
+void Stepper::_shaperCalibrateEnd() {
+  _shaperCalibration.active = false;
+  _shaperCalibrateTask->disable();
+  _plannedMove = false;
+  _planner.setShaper(_shaper, _shaperFrequency, _shaperDamping);
+  _chopperMode = ChopperMode::AUTO;
+  _applyChopperMode();
+  _stepper_driver.flush();
+}
+
+// the resonance is the peak of the load, its damping ratio is taken from the width (half power)
+void Stepper::_shaperCalibrateFinish(const char* warning) {
+  _shaperCalibrateEnd();
+  _motorState = MotorState::IDLE;
+  _movementDirection = MotorDirection::STANDSTILL;
+  _setLEDMode(LED::LEDMode::IDLE);
+
+  const std::vector<uint16_t>& response = _shaperCalibration.response;
+  size_t peak = 0;
+  uint16_t unloaded = 0;
+  for (size_t i = 0; i < response.size(); i++) {
+    if (response[i] < response[peak])
+      peak = i;
+    unloaded = max(unloaded, response[i]);
+  }
+  if (warning == nullptr && (response.empty() || unloaded == response[peak]))
+    warning = "No resonance found!";
+
+  if (warning != nullptr) {
+    LOGW(TAG, "%s", warning);
+    // send websock event
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = warning;
+    eventBus.publish(event);
+  } else {
+    // frequencies where the load falls to 1/sqrt(2) of the peak (interpolated)
+    float level = (unloaded - response[peak]) / sqrtf(2);
+    float frequency = SHAPER_CALIBRATE_FREQUENCY_MIN + peak * SHAPER_CALIBRATE_FREQUENCY_STEP;
+    float lower = 0;
+    float upper = 0;
+    for (size_t i = peak; i > 0; i--) {
+      float inner = unloaded - response[i];
+      float outer = unloaded - response[i - 1];
+      if (outer < level) {
+        lower = SHAPER_CALIBRATE_FREQUENCY_MIN + (i - (inner - level) / (inner - outer)) * SHAPER_CALIBRATE_FREQUENCY_STEP;
+        break;
+      }
+    }
+    for (size_t i = peak; i + 1 < response.size(); i++) {
+      float inner = unloaded - response[i];
+      float outer = unloaded - response[i + 1];
+      if (outer < level) {
+        upper = SHAPER_CALIBRATE_FREQUENCY_MIN + (i + (inner - level) / (inner - outer)) * SHAPER_CALIBRATE_FREQUENCY_STEP;
+        break;
+      }
+    }
+    // the peak might be at the border of the sweep, keep the known damping then
+    float damping = (lower > 0 && upper > 0) ? constrain((upper - lower) / (2 * frequency), 0.01f, 0.5f) : _shaperDamping;
+    LOGI(TAG, "Resonance at %.1f Hz (damping: %.3f)", frequency, damping);
+    setShaper(_shaper, frequency, damping);
+    // send websock event
+    eventBus.publish(configEvent());
+  }
+
+  // send websock event
+  MotorEvent event = _motorStateEvent(_motorState);
+  event.setMoveState(getCurrentPosition(), 0, _telemetryCurrentScale);
+  eventBus.publish(event);
+}
+
+// re-Initialization
+void Stepper::_reInitTMC2209(bool powerOnHoming) {
+  LOGI(TAG, "Running TMC2209 re-initialization routine...");
+  // the driver lost its registers, write all of them again (StallGuard is off again)
+  _switchHoming = SwitchHoming::NONE;
+  _stallHoming = StallHoming::NONE;
+  _homingCheckTask->disable();
+  _characterization.phase = Characterization::NONE;
+  _characterizeTask->disable();
+  if (_shaperCalibration.active) {
+    _shaperCalibration.active = false;
+    _shaperCalibrateTask->disable();
+    _planner.setShaper(_shaper, _shaperFrequency, _shaperDamping);
+  }
+  if (_microsteps != USTEPS_PER_STEP)
+    _setMicrosteps(USTEPS_PER_STEP, _currentPosition());
+  _microstepSwitch = MicrostepSwitch::NONE;
+  _currentSampling = false;
+  _cruiseCurrent = false;
+  _stallRecovery = StallRecovery::NONE;
+  _stallSampling = false;
+  _stallMonitorTask->disable();
+  _stepper_driver.invalidate();
+  // 16 µSteps & 1.8°/per step --> 3200 (200*16) µSteps per rev --> with 8mm pitch --> 400 µSteps per mm
+  _stepper_driver.setMicrostepsPerStep(USTEPS_PER_STEP);
+  _stepper_driver.enableInverseMotorDirection();
+
+  // configure TMC
+  _stepper_driver.useExternalSenseResistors();
+  // calculated for: [E Series Nema 17 Stepper 2A 55Ncm 1.8°](https://www.omc-stepperonline.com/e-series-nema-17-bipolar-55ncm-77-88oz-in-2a-42x48mm-4-wires-w-1m-cable-connector-17he19-2004s)
+  // using the [TMC2209 Calculator](https://www.analog.com/media/en/engineering-tools/design-tools/tmc2209_calculations.xlsx)
+  // (scaled by the current schedule)
+  _applyCurrentSchedule();
+
+  // activate StealthChop and CoolStep with the (tuned) thresholds
+  _chopperMode = ChopperMode::AUTO;
+  _applyChopperMode();
+
+  // don't use stall guard
+  _stepper_driver.setStallGuardThreshold(0);
+
+  // set the known values for gradient and offset
+  _stepper_driver.setPwmGradient(_pwmGradient);
+  _stepper_driver.setPwmOffset(_pwmOffset);
+  _stepper_driver.enableAutomaticCurrentScaling();
+  _stepper_driver.enableAutomaticGradientAdaptation();
+
+  // software-enable TMC2209
+  _stepper_driver.enable();
+  _stepper_driver.flush();
+  // Hardware-disable the motor (unless holding)
+  if (!_holdPosition)
+    digitalWrite(TMC_EN, HIGH);
+  _applyStandstillMode();
+
+  // Final check of driver (after the registers were written)
+  _stepper_driver.refresh(TMC2209Driver::REFRESH_COMMUNICATION, [this, powerOnHoming](bool) { _reInitTMC2209Check(powerOnHoming); });
+}
+
+void Stepper::_reInitTMC2209Check(bool powerOnHoming) {
+  if (_stepper_driver.isSetupAndCommunicating()) {
+    LOGI(TAG, "Stepper driver is setup and communicating!");
+    _initializationState = InitializationState::OK;
+    _driverComState = DriverComState::OK;
+    _motorState = MotorState::IDLE;
+    _setLEDMode(LED::LEDMode::IDLE);
+
+    // send websock event
+    eventBus.publish(_motorStateEvent(_motorState));
+
+    // possibly do power-on homing
+    if (powerOnHoming && !_homed && _autoHome) {
+      do_homing();
+    }
+  } else {
+    LOGE(TAG, "Stepper driver setup failed!");
+    _stepper->setAutoEnable(false);
+    _initializationState = InitializationState::UNITITIALIZED;
+    _driverComState = DriverComState::ERROR;
+    _motorState = MotorState::ERROR;
+    _setLEDMode(LED::LEDMode::ERROR);
+
+    // send websock event
+    eventBus.publish(_motorStateEvent(_motorState));
+  }
+}
+
+// final part of initialization
+void Stepper::_initTMC2209Finished() {
+  LOGD(TAG, "Final pwmAutoScale: %d", _stepper_driver.getPwmScaleAuto());
+  // Hardware-disable the motor
+  digitalWrite(TMC_EN, HIGH);
+  // Software-disable TMC2209
+  _stepper_driver.disable();
+  _stepper_driver.flush();
+
+  // activate StealthChop and CoolStep with the (tuned) thresholds
+  _chopperMode = ChopperMode::AUTO;
+  _applyChopperMode();
+
+  // software-enable TMC2209
+  _stepper_driver.enable();
+  // set power saving or holding standstill mode
+  _applyStandstillMode();
+
+  // Final check of driver (after the registers were written)
+  _stepper_driver.refresh(TMC2209Driver::REFRESH_COMMUNICATION, [&](bool) { _initTMC2209Check(); });
+}
+
+void Stepper::_initTMC2209Check() {
+  if (_stepper_driver.isSetupAndCommunicating()) {
+    LOGI(TAG, "Stepper driver is setup and communicating!");
+    _initializationState = InitializationState::OK;
+    _driverComState = DriverComState::OK;
+    _motorState = MotorState::IDLE;
+    _setLEDMode(LED::LEDMode::IDLE);
+  } else {
+    LOGE(TAG, "Stepper driver setup failed!");
+    _stepper->setAutoEnable(false);
+    _initializationState = InitializationState::UNITITIALIZED;
+    _driverComState = DriverComState::ERROR;
+    _motorState = MotorState::ERROR;
+    _setLEDMode(LED::LEDMode::ERROR);
+
+    // send websock event
+    eventBus.publish(_motorStateEvent(_motorState));
+
+    // bail out, the check-Task might be able to recover from this mess!
+    return;
+  }
+
+  // possibly do power-on homing
+  if (!_homed && _autoHome) {
+    do_homing();
+  } else {
+    // send websock event
+    MotorEvent event = _motorStateEvent(_motorState);
+    event.setMoveState(0, 0, _telemetryCurrentScale);
+    eventBus.publish(event);
+  }
+}
+
+// gradient calibration callback
+void Stepper::_checkTMC2209Gradient() {
+  _stepper_driver.refresh(TMC2209Driver::REFRESH_PWM, [&](bool) { _checkTMC2209GradientResult(); });
+}
+
+void Stepper::_checkTMC2209GradientResult() {
+  int16_t pwmAutoScale = _stepper_driver.getPwmScaleAuto();
+  LOGD(TAG, "Check pwmAutoScale: %d", pwmAutoScale);
+  if (abs(pwmAutoScale) < 10) {
+    _initTMC2209Finished();
+    // Remember values to skip initialization on power loss (and next boot)
+    _pwmGradient = _stepper_driver.getPwmGradientAuto();
+    _pwmOffset = _stepper_driver.getPwmOffsetAuto();
+    _savePwmCalibration();
+  } else {
+    // Try again in half a second
+    Task* optimizeGradientTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _initTMC2209Gradient(); }, _scheduler, false, NULL, NULL, true);
+    optimizeGradientTask->enableDelayed(500);
+  }
+}
+
+// gradient calibration callback
+void Stepper::_initTMC2209Gradient(bool startAdaptation) {
+  // set movement speed to 250 rpm
+  _stepper->setSpeedInMilliHz(HOMING_SPEED);
+
+  // set acceleration
+  _stepper->setAcceleration(HOMING_ACCELERATION);
+
+  // we're at the homing button, move 3 mm away from home
+  if ((_initializationState == InitializationState::GRADIENT_HOME) || !digitalRead(TMC_HOME)) {
+    _movementDirection = MotorDirection::FORWARDS;
+    _initializationState = InitializationState::GRADIENT_DEHOMING;
+    _stepper->move(3 * STEPS_PER_MM);
+    // Wait for 500 ms and check result
+    Task* optimizeGradientDeHomingTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _checkTMC2209Gradient(); }, _scheduler, false, NULL, NULL, true);
+    optimizeGradientDeHomingTask->enableDelayed(500);
+  } else { // just move 2 mm towards home
+    _movementDirection = MotorDirection::BACKWARDS;
+    _initializationState = InitializationState::GRADIENT_HOMING;
+    _stepper->move(-2 * STEPS_PER_MM);
+    // Wait for 500 ms and check result
+    Task* optimizeGradientHomingTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _checkTMC2209Gradient(); }, _scheduler, false, NULL, NULL, true);
+    optimizeGradientHomingTask->enableDelayed(500);
+  }
+
+  // start adaptation if requested (not running yet)
+  if (startAdaptation) {
+    _stepper_driver.refresh(TMC2209Driver::REFRESH_PWM, [&](bool) { LOGD(TAG, "Starting pwmAutoScale: %d", _stepper_driver.getPwmScaleAuto()); });
+    _stepper_driver.enableAutomaticGradientAdaptation();
+    _stepper_driver.flush();
+  }
+}
+
+// Initial part of initialization
 void Stepper::_initTMC2209() {
   // possibly delay initialization if network isn't connected to WiFi
   // like programming...
@@ -406,28 +1665,33 @@ void Stepper::_initTMC2209() {
   }
 
   // Reflect state
+  _switchHoming = SwitchHoming::NONE;
+  _stallHoming = StallHoming::NONE;
+  _homingCheckTask->disable();
+  _characterization.phase = Characterization::NONE;
+  _characterizeTask->disable();
+  _stallRecovery = StallRecovery::NONE;
+  _stallMonitorTask->disable();
   _driverComState = DriverComState::UNKNOWN;
   _motorState = MotorState::UNINITIALIZED;
   _initializationState = InitializationState::UNITITIALIZED;
-  led.setMode(LED::LEDMode::INITIALIZING);
+  _setLEDMode(LED::LEDMode::INITIALIZING);
 
   // Start communication with driver
-  _stepper_driver.setup(Serial1, 115200, TMC2209::SerialAddress::SERIAL_ADDRESS_0, TMC_RX, TMC_TX);
+  _stepper_driver.setup(Serial1, 115200, TMC2209Driver::SerialAddress::SERIAL_ADDRESS_0, TMC_RX, TMC_TX);
+  _stepper_driver.refresh(TMC2209Driver::REFRESH_ALL, [&](bool) { _initTMC2209Communication(); });
+}
 
+// called with the first status read from the driver
+void Stepper::_initTMC2209Communication() {
   // Check if the driver is responding, otherwise the power might have failed
   if (!_stepper_driver.isCommunicating()) {
     LOGW(TAG, "Driver is not communicating, delay initialization");
     _driverComState = DriverComState::ERROR;
-    led.setMode(LED::LEDMode::ERROR);
+    _setLEDMode(LED::LEDMode::ERROR);
 
-    // execute callback (from website)
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = getMotorState_as_string().c_str();
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
+    // send websock event
+    eventBus.publish(_motorStateEvent(_motorState));
 
     // delay initialization if driver is not communicating, yet
     Task* initDelayedStartupTMC2209Task = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _initTMC2209(); }, _scheduler, false, NULL, NULL, true);
@@ -435,6 +1699,9 @@ void Stepper::_initTMC2209() {
     return;
   }
 
+  // come back ready when the retained position is still valid
+  _restorePosition();
+
   // Set up a task for continuously monitoring the driver
   if (_checkTMC2209Task == nullptr) {
     LOGD(TAG, "starting _checkTMC2209Task");
@@ -442,6 +1709,13 @@ void Stepper::_initTMC2209() {
     _checkTMC2209Task->enableDelayed(1000);
   }
 
+  // skip the calibration (and its movement) when the values are known already
+  if (_pwmCalibrated) {
+    LOGI(TAG, "Using stored PWM calibration (gradient: %d, offset: %d)", _pwmGradient, _pwmOffset);
+    _reInitTMC2209(true);
+    return;
+  }
+
   LOGI(TAG, "Running TMC2209 initialization routine%s", _driverComState == DriverComState::UNKNOWN ? "..." : " again!");
   // 16 µSteps & 1.8°/per step --> 3200 (200*16) µSteps per rev --> with 8mm pitch --> 400 µSteps per mm
   _stepper_driver.setMicrostepsPerStep(USTEPS_PER_STEP);
@@ -450,9 +1724,9 @@ void Stepper::_initTMC2209() {
   _stepper_driver.useExternalSenseResistors();
   // calculated for: [E Series Nema 17 Stepper 2A 55Ncm 1.8°](https://www.omc-stepperonline.com/e-series-nema-17-bipolar-55ncm-77-88oz-in-2a-42x48mm-4-wires-w-1m-cable-connector-17he19-2004s)
   // using the [TMC2209 Calculator](https://www.analog.com/media/en/engineering-tools/design-tools/tmc2209_calculations.xlsx)
-  _stepper_driver.setRMSCurrent(1414, 0.11);
+  _stepper_driver.setRMSCurrent(TMC_RMS_CURRENT, TMC_R_SENSE);
   // set standstill mode to use IHOLD for calibration
-  _stepper_driver.setStandstillMode(TMC2209::StandstillMode::NORMAL);
+  _stepper_driver.setStandstillMode(TMC2209Driver::StandstillMode::NORMAL);
   _stepper_driver.enableInverseMotorDirection();
 
   // enable StealthChop for initialization
@@ -466,55 +1740,61 @@ void Stepper::_initTMC2209() {
   _stepper_driver.setStallGuardThreshold(0);
 
   // do automatic offset calibration
+  _invalidatePosition();
   // 1. enable motor driver and (blockingly) do one step
   digitalWrite(TMC_EN, LOW);
   _stepper_driver.enable();
   _stepper->setAutoEnable(false);
-  _stepper->backwardStep(true);
-  // 2. do standstill calibration (should take ~130ms)
-  _stepper_driver.enableAutomaticCurrentScaling();
-  // wait (non-blockingly) for 250ms and continue initialization (for gradient) in a new task
-  Task* optimizeGradientTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _initTMC2209Gradient(true); }, _scheduler, false, NULL, NULL, true);
-  optimizeGradientTask->enableDelayed(250);
+  _stepper_driver.flush([&](bool) {
+    _stepper->backwardStep(true);
+    // 2. do standstill calibration (should take ~130ms)
+    _stepper_driver.enableAutomaticCurrentScaling();
+    _stepper_driver.flush();
+    // wait (non-blockingly) for 250ms and continue initialization (for gradient) in a new task
+    Task* optimizeGradientTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _initTMC2209Gradient(true); }, _scheduler, false, NULL, NULL, true);
+    optimizeGradientTask->enableDelayed(250);
+  });
 }
 
 void Stepper::_checkTMC2209() {
+  // status registers in one batch, evaluated when they were read
+  _stepper_driver.refresh(TMC2209Driver::REFRESH_COMMUNICATION | TMC2209Driver::REFRESH_GLOBAL_STATUS | TMC2209Driver::REFRESH_DRIVER_STATUS | TMC2209Driver::REFRESH_MICROSTEPS, [&](bool) { _checkTMC2209Status(); });
+}
+
+void Stepper::_checkTMC2209Status() {
   if (_stepper_driver.isSetupAndCommunicating()) {
     if (_driverComState != DriverComState::OK) {
       LOGD(TAG, "Stepper driver is setup and communicating, now!");
       _driverComState = DriverComState::OK;
       _motorState = MotorState::IDLE;
-      led.setMode(LED::LEDMode::IDLE);
+      _setLEDMode(LED::LEDMode::IDLE);
 
-      // execute callback (from website)
-      if (_motorEventCallback != nullptr) {
-        JsonDocument jsonMsg;
-        jsonMsg["type"] = "motor_state";
-        jsonMsg["state"] = getMotorState_as_string().c_str();
-        jsonMsg.shrinkToFit();
-        _motorEventCallback(jsonMsg);
-      }
+      // send websock event
+      eventBus.publish(_motorStateEvent(_motorState));
     }
+
+    // keep track of the position at standstill
+    if (_initializationState == InitializationState::OK && !_stepper->isRunning() && !_planner.isActive())
+      _recordPosition();
+    _checkThermal();
   } else if (_stepper_driver.isCommunicatingButNotSetup()) {
     // check if motor is running (fastAccelStepper)
     if (_stepper->getCurrentSpeedInMilliHz() != 0) {
+      _planner.abort();
       _stepper->forceStop();
     }
     if (_driverComState != DriverComState::UNINITIALIZED) {
       LOGW(TAG, "Stepper driver is communicating but not setup, now!");
       _driverComState = DriverComState::UNINITIALIZED;
       _motorState = MotorState::UNINITIALIZED;
-      led.setMode(LED::LEDMode::INITIALIZING);
+      _setLEDMode(LED::LEDMode::INITIALIZING);
 
-      // execute callback (from website)
-      if (_motorEventCallback != nullptr) {
-        JsonDocument jsonMsg;
-        jsonMsg["type"] = "motor_state";
-        jsonMsg["state"] = getMotorState_as_string().c_str();
-        jsonMsg.shrinkToFit();
-        _motorEventCallback(jsonMsg);
-      }
+      // send websock event
+      eventBus.publish(_motorStateEvent(_motorState));
     }
+    // the driver might have been reset
+    _restorePosition();
+
     // Set up a task for (re-)initializing the driver
     if (_initializationState == InitializationState::OK) {
       Task* reInitTMC2209Task = new Task(100, TASK_ONCE, [&] { _reInitTMC2209(); }, _scheduler, false, NULL, NULL, true);
@@ -526,236 +1806,728 @@ void Stepper::_checkTMC2209() {
   } else {
     // check if motor is running (fastAccelStepper)
     if (_stepper->getCurrentSpeedInMilliHz() != 0) {
+      _planner.abort();
       _stepper->forceStop();
     }
     if (_driverComState != DriverComState::ERROR) {
       LOGE(TAG, "Stepper driver is not communicating, now!");
       _driverComState = DriverComState::ERROR;
       _motorState = MotorState::ERROR;
-      led.setMode(LED::LEDMode::ERROR);
+      _setLEDMode(LED::LEDMode::ERROR);
 
-      // execute callback (from website)
-      if (_motorEventCallback != nullptr) {
-        JsonDocument jsonMsg;
-        jsonMsg["type"] = "motor_state";
-        jsonMsg["state"] = getMotorState_as_string().c_str();
-        jsonMsg["error"] = DriverError_string_map[DriverError::UNKNOWN].c_str();
-        jsonMsg.shrinkToFit();
-        _motorEventCallback(jsonMsg);
-      }
+      // send websock event
+      MotorEvent event = _motorStateEvent(_motorState);
+      event.error = DriverError_string_map[DriverError::UNKNOWN].c_str();
+      eventBus.publish(event);
+    }
+  }
+}
+
+// called by the website (AsyncTCP task), the command is handled by the scheduler
+void Stepper::_webEventCallback(const MotorCommand& command) {
+  // stopping bypasses the queue, it can't be lost when the queue is full
+  if (command.type == MotorCommand::Type::STOP) {
+    _stopRequested.store(true, std::memory_order_release);
+    return;
+  }
+  if (!_commandQueue.push(command)) {
+    LOGW(TAG, "Command queue full, dropped command!");
+  }
+}
+
+void Stepper::_commandCallback() {
+  // ending was requested by another task
+  _schedulerTask = xTaskGetCurrentTaskHandle();
+  if (_endRequested.load(std::memory_order_acquire)) {
+    _end();
+    _endRequested.store(false, std::memory_order_release);
+    return;
+  }
+
+  MotorCommand command;
+  bool stopped = _stopRequested.exchange(false, std::memory_order_acquire);
+  if (stopped) {
+    command = {};
+    command.type = MotorCommand::Type::STOP;
+    _handleCommand(command);
+  }
+  while (_commandQueue.pop(&command)) {
+    // movements still waiting are cancelled by stopping
+    if (stopped && command.type != MotorCommand::Type::UPDATE_CONFIG) {
+      LOGD(TAG, "Discarded command %d after stopping", static_cast<int>(command.type));
+      continue;
     }
+    _handleCommand(command);
+  }
+
+  // let the clients know about commands which were lost
+  uint32_t dropped = _commandQueue.getDropped();
+  if (dropped != _commandsDropped) {
+    _commandsDropped = dropped;
+    // send websock event
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = "Commands dropped!";
+    eventBus.publish(event);
   }
 }
 
-void Stepper::_webEventCallback(JsonDocument doc) {
-  LOGD(TAG, "Received Command: %s from client: %d", doc["type"].as<const char*>(), doc["origin"].as<int32_t>());
+void Stepper::_handleCommand(const MotorCommand& command) {
+  LOGD(TAG, "Received Command: %d from client: %d", static_cast<int>(command.type), command.origin);
+
+  // no moves while the driver is switched off for cooling down
+  if (_thermalState == ThermalState::SHUTDOWN && command.type != MotorCommand::Type::STOP && command.type != MotorCommand::Type::UPDATE_CONFIG) {
+    LOGW(TAG, "Driver is cooling down!");
+    // send websock event
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = "Driver is cooling down!";
+    eventBus.publish(event);
+    return;
+  }
+
+  switch (command.type) {
+    case MotorCommand::Type::MOVE: {
+      LOGD(TAG, "Motor shall move to %d mm at %d mm/s with %d mm/ss (jerk %d mm/sss)", command.position, command.speed, command.acceleration, command.jerk);
+
+      // Can we start/update a movement?
+      if ((_motorState == MotorState::DRIVING) || (_motorState == MotorState::IDLE)) {
+        if (_destination_position == command.position && _destination_speed == _limitSpeed(command.speed)) {
+          LOGD(TAG, "Motor movement parameters are identical to current move!");
+          // send websock event
+          eventBus.publish(_motorStateEvent(MotorState::ARRIVED));
+          return;
+        }
+
+        if (command.speed == 0) {
+          LOGD(TAG, "Motor speed is 0!");
+          // send websock event
+          MotorEvent event = _motorStateEvent(MotorState::WARNING);
+          event.warning = "Speed unplausible!";
+          eventBus.publish(event);
+          return;
+        }
+      } else {
+        LOGW(TAG, "Motor movement not allowed!");
+        // send websock event
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Movement not allowed!";
+        eventBus.publish(event);
+        return;
+      }
+
+      // a planned move is taken over by FastAccelStepper's ramp generator (unshaped, see start_move)
+      if (_plannedMove) {
+        LOGD(TAG, "Planned move taken over!");
+        _planner.abort();
+        if (_feedQueueTask != nullptr) {
+          _feedQueueTask->disable();
+          _feedQueueTask = nullptr;
+        }
+        _plannedMove = false;
+      }
+
+      _selectChopperMode((command.options & MotorCommand::CHOPPER_MODE) ? static_cast<ChopperMode>(command.chopperMode) : ChopperMode::AUTO);
+      _stallRetry.count = 0;
+      start_move(command.position, command.speed, command.acceleration, command.jerk, command.origin);
+      break;
+    }
+
+    case MotorCommand::Type::MOVE_SEQUENCE: { // Move through several waypoints
+      LOGD(TAG, "Motor shall move through %d waypoints", command.waypointCount);
+
+      // Can we start a movement? (FastAccelStepper's queue must be idle)
+      if (_motorState != MotorState::IDLE || _stepper->isRunning()) {
+        LOGW(TAG, "Motor movement not allowed!");
+        // send websock event
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Movement not allowed!";
+        eventBus.publish(event);
+        return;
+      }
+
+      // speed and acceleration of a waypoint default to the ones of the sequence (or the last move)
+      int32_t speed = (command.options & MotorCommand::SPEED) ? command.speed : _destination_speed;
+      int32_t acceleration = (command.options & MotorCommand::ACCELERATION) ? command.acceleration : _destination_acceleration;
+      std::vector<MotorWaypoint> sequence;
+      if (command.waypointCount <= PLANNER_MAX_WAYPOINTS) {
+        sequence.reserve(command.waypointCount);
+        for (uint16_t i = 0; i < command.waypointCount; i++) {
+          const MotorWaypoint& waypoint = command.waypoints[i];
+          sequence.push_back({waypoint.position, waypoint.speed ? waypoint.speed : speed, waypoint.acceleration ? waypoint.acceleration : acceleration});
+          if (sequence.back().speed <= 0 || sequence.back().acceleration <= 0) {
+            sequence.clear();
+            break;
+          }
+        }
+      }
+
+      if (sequence.empty()) {
+        LOGD(TAG, "Motor sequence is unplausible!");
+        // send websock event
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Sequence unplausible!";
+        eventBus.publish(event);
+        return;
+      }
+
+      _selectChopperMode((command.options & MotorCommand::CHOPPER_MODE) ? static_cast<ChopperMode>(command.chopperMode) : ChopperMode::AUTO);
+      start_sequence(sequence, command.jerk, command.origin);
+      break;
+    }
+
+    case MotorCommand::Type::JOG: { // Jog command
+      // Can we start/update jogging?
+      if ((_motorState == MotorState::IDLE && !_stepper->isRunning()) || (_motorState == MotorState::DRIVING && _jogging)) {
+        _selectChopperMode((command.options & MotorCommand::CHOPPER_MODE) ? static_cast<ChopperMode>(command.chopperMode) : ChopperMode::AUTO);
+        jog(command.speed, (command.options & MotorCommand::ACCELERATION) ? command.acceleration : _destination_acceleration, command.origin);
+      } else {
+        LOGW(TAG, "Jogging not allowed!");
+        // send websock event
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Jogging not allowed!";
+        eventBus.publish(event);
+      }
+      break;
+    }
+
+    case MotorCommand::Type::STOP: { // Stop command
+      LOGD(TAG, "Motor shall be stopped");
+
+      // Can we stop a movement?
+      if ((_motorState == MotorState::DRIVING) || (_motorState == MotorState::HOMING) || (_motorState == MotorState::CHARACTERIZING)) {
+        halt_move();
+      } else {
+        LOGW(TAG, "Stopping not allowed!");
+        // send websock event
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Stopping not allowed!";
+        eventBus.publish(event);
+      }
+      break;
+    }
+
+    case MotorCommand::Type::HOME: { // Homing command
+      LOGD(TAG, "Motor shall go/find home");
+
+      // Can we start the homing procedure?
+      if (_motorState == MotorState::IDLE) {
+        do_homing();
+      } else {
+        LOGW(TAG, "Homing not allowed!");
+        // send websock event
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Homing not allowed!";
+        eventBus.publish(event);
+      }
+      break;
+    }
+
+    case MotorCommand::Type::CALIBRATE: { // Calibration command
+      LOGD(TAG, "Driver shall be calibrated");
+
+      // Can we move for the calibration?
+      if (_motorState == MotorState::IDLE && !_stepper->isRunning()) {
+        calibrate();
+      } else {
+        LOGW(TAG, "Calibration not allowed!");
+        // send websock event
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Calibration not allowed!";
+        eventBus.publish(event);
+      }
+      break;
+    }
+
+    case MotorCommand::Type::CHARACTERIZE: { // Characterization command
+      LOGD(TAG, "Limits shall be characterized");
+      if (_canTestAlongStroke(CharacterizationMode::LIMITS))
+        characterize();
+      break;
+    }
+
+    case MotorCommand::Type::TUNE_CHOPPER: { // Chopper tuning command
+      LOGD(TAG, "Chopper thresholds shall be tuned");
+      if (_canTestAlongStroke(CharacterizationMode::CHOPPER))
+        tuneChopper();
+      break;
+    }
+
+    case MotorCommand::Type::MAP_RESONANCES: { // Resonance mapping command
+      LOGD(TAG, "Resonances shall be mapped");
+      if (_canTestAlongStroke(CharacterizationMode::RESONANCES))
+        mapResonances();
+      break;
+    }
 
-  // Move command
-  if (strcmp(doc["type"].as<const char*>(), "move") == 0) {
-    LOGD(TAG, "Motor shall move to %d mm at %d mm/s with %d mm/ss", doc["position"].as<int32_t>(), doc["speed"].as<int32_t>(), doc["acceleration"].as<int32_t>());
+    case MotorCommand::Type::CALIBRATE_SHAPER: { // Shaper calibration command
+      LOGD(TAG, "Input shaper shall be calibrated");
 
-    // Can we start/update a movement?
-    if ((_motorState == MotorState::DRIVING) || (_motorState == MotorState::IDLE)) {
-      if (_destination_position == doc["position"].as<int32_t>() && _destination_speed == doc["speed"].as<int32_t>()) {
-        LOGD(TAG, "Motor movement parameters are identical to current move!");
+      // Can we oscillate for the calibration? (away from home)
+      if (!_homed) {
+        LOGW(TAG, "Shaper calibration needs homing!");
         // send websock event
-        if (_motorEventCallback != nullptr) {
-          JsonDocument jsonMsg;
-          jsonMsg["type"] = "motor_state";
-          jsonMsg["state"] = MotorState_string_map[MotorState::ARRIVED].c_str();
-          jsonMsg.shrinkToFit();
-          _motorEventCallback(jsonMsg);
-        }
-        return;
-      }
-
-      if (doc["speed"].as<int32_t>() == 0) {
-        LOGD(TAG, "Motor speed is 0!");
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Shaper calibration needs homing!";
+        eventBus.publish(event);
+      } else if (_motorState == MotorState::IDLE && !_stepper->isRunning()) {
+        calibrateShaper();
+      } else {
+        LOGW(TAG, "Shaper calibration not allowed!");
         // send websock event
-        if (_motorEventCallback != nullptr) {
-          JsonDocument jsonMsg;
-          jsonMsg["type"] = "motor_state";
-          jsonMsg["state"] = MotorState_string_map[MotorState::WARNING].c_str();
-          jsonMsg["warning"] = "Speed unplausible!";
-          jsonMsg.shrinkToFit();
-          _motorEventCallback(jsonMsg);
-        }
-        return;
-      }
-    } else {
-      LOGW(TAG, "Motor movement not allowed!");
-      // send websock event
-      if (_motorEventCallback != nullptr) {
-        JsonDocument jsonMsg;
-        jsonMsg["type"] = "motor_state";
-        jsonMsg["state"] = MotorState_string_map[MotorState::WARNING].c_str();
-        jsonMsg["warning"] = "Movement not allowed!";
-        jsonMsg.shrinkToFit();
-        _motorEventCallback(jsonMsg);
+        MotorEvent event = _motorStateEvent(MotorState::WARNING);
+        event.warning = "Shaper calibration not allowed!";
+        eventBus.publish(event);
       }
-      return;
+      break;
     }
 
-    start_move(doc["position"].as<int32_t>(), doc["speed"].as<int32_t>(), doc["acceleration"].as<int32_t>(), doc["origin"].as<int32_t>());
-  } else if (strcmp(doc["type"].as<const char*>(), "stop") == 0) { // Stop command
-    LOGD(TAG, "Motor shall be stopped");
+    case MotorCommand::Type::UPDATE_CONFIG: { // Config command
+      LOGD(TAG, "Update config");
 
-    // Can we stop a movement?
-    if ((_motorState == MotorState::DRIVING) || (_motorState == MotorState::HOMING)) {
-      halt_move();
-    } else {
-      LOGW(TAG, "Stopping not allowed!");
-      // send websock event
-      if (_motorEventCallback != nullptr) {
-        JsonDocument jsonMsg;
-        jsonMsg["type"] = "motor_state";
-        jsonMsg["state"] = MotorState_string_map[MotorState::WARNING].c_str();
-        jsonMsg["warning"] = "Stopping not allowed!";
-        jsonMsg.shrinkToFit();
-        _motorEventCallback(jsonMsg);
+      // Update config
+      if (command.options & MotorCommand::AUTO_HOME) {
+        setAutoHome(command.config.autoHome);
+      }
+      if (command.options & MotorCommand::JOG_TIMEOUT) {
+        setJogTimeout(command.config.jogTimeout);
+      }
+      if (command.options & MotorCommand::HOLD_POSITION) {
+        setHoldPosition(command.config.holdPosition);
+      }
+      if (command.options & (MotorCommand::MAX_SPEED | MotorCommand::MAX_ACCELERATION)) {
+        setLimits((command.options & MotorCommand::MAX_SPEED) ? command.config.maxSpeed : _maxSpeed,
+                  (command.options & MotorCommand::MAX_ACCELERATION) ? command.config.maxAcceleration : _maxAcceleration);
+      }
+      if (command.options & (MotorCommand::HOMING_MODE | MotorCommand::STALL_THRESHOLD)) {
+        setHomingMode((command.options & MotorCommand::HOMING_MODE) ? static_cast<HomingMode>(command.config.homingMode) : _homingMode,
+                      (command.options & MotorCommand::STALL_THRESHOLD) ? command.config.stallThreshold : _stallThreshold);
+      }
+      if (command.options & (MotorCommand::SHAPER | MotorCommand::SHAPER_FREQUENCY | MotorCommand::SHAPER_DAMPING)) {
+        setShaper((command.options & MotorCommand::SHAPER) ? static_cast<MotionPlanner::Shaper>(command.config.shaper) : _shaper,
+                  (command.options & MotorCommand::SHAPER_FREQUENCY) ? command.config.shaperFrequency : _shaperFrequency,
+                  (command.options & MotorCommand::SHAPER_DAMPING) ? command.config.shaperDamping : _shaperDamping);
+      }
+      if (command.options & MotorCommand::RESONANCE_MAP) {
+        setResonanceMap(command.config.resonanceMap);
+      }
+      if (command.options & MotorCommand::STROKE_LENGTH) {
+        setStrokeLength(command.config.strokeLength);
+      }
+      if (command.options & MotorCommand::STALL_POLICY) {
+        setStallPolicy(static_cast<StallPolicy>(command.config.stallPolicy));
+      }
+      if (command.options & (MotorCommand::COOLSTEP_MIN | MotorCommand::COOLSTEP_MAX)) {
+        setCoolStepWindow((command.options & MotorCommand::COOLSTEP_MIN) ? command.config.coolStepMin : _coolStepMin,
+                          (command.options & MotorCommand::COOLSTEP_MAX) ? command.config.coolStepMax : _coolStepMax);
+      }
+      if (command.options & (MotorCommand::CURRENT_ACCELERATION | MotorCommand::CURRENT_CRUISE | MotorCommand::CURRENT_HOLD)) {
+        setCurrentSchedule((command.options & MotorCommand::CURRENT_ACCELERATION) ? command.config.currentAcceleration : _currentAcceleration,
+                           (command.options & MotorCommand::CURRENT_CRUISE) ? command.config.currentCruise : _currentCruise,
+                           (command.options & MotorCommand::CURRENT_HOLD) ? command.config.currentHold : _currentHold);
+      }
+      if (command.options & (MotorCommand::POSITION_DEADBAND | MotorCommand::SPEED_DEADBAND)) {
+        setTelemetryDeadband((command.options & MotorCommand::POSITION_DEADBAND) ? command.config.positionDeadband : _positionDeadband,
+                             (command.options & MotorCommand::SPEED_DEADBAND) ? command.config.speedDeadband : _speedDeadband);
       }
-    }
-  } else if (strcmp(doc["type"].as<const char*>(), "home") == 0) { // Homing command
-    LOGD(TAG, "Motor shall go/find home");
 
-    // Can we start the homing procedure?
-    if (_motorState == MotorState::IDLE) {
-      do_homing();
-    } else {
-      LOGW(TAG, "Homing not allowed!");
       // send websock event
-      if (_motorEventCallback != nullptr) {
-        JsonDocument jsonMsg;
-        jsonMsg["type"] = "motor_state";
-        jsonMsg["state"] = MotorState_string_map[MotorState::WARNING].c_str();
-        jsonMsg["warning"] = "Homing not allowed!";
-        jsonMsg.shrinkToFit();
-        _motorEventCallback(jsonMsg);
-      }
+      MotorEvent event = configEvent();
+      event.setOrigin(command.origin);
+      eventBus.publish(event);
+      break;
     }
-  } else if (strcmp(doc["type"].as<const char*>(), "update_config") == 0) { // Config command
-    LOGD(TAG, "Update config");
-
-    // Update config
-    stepper.setAutoHome(doc["autoHome"].as<bool>());
 
-    // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "config";
-      jsonMsg["autoHome"] = stepper.getAutoHome();
-      jsonMsg["origin"] = doc["origin"].as<int32_t>();
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
-  } else {
-    // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = MotorState_string_map[MotorState::WARNING].c_str();
-      jsonMsg["warning"] = "Unknown command received!";
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
+    default: {
+      // send websock event
+      MotorEvent event = _motorStateEvent(MotorState::WARNING);
+      event.warning = "Unknown command received!";
+      eventBus.publish(event);
+      break;
     }
   }
 }
 
-void Stepper::start_move(int32_t position, int32_t speed, int32_t acceleration, int32_t clientID) {
+void Stepper::start_move(int32_t position, int32_t speed, int32_t acceleration, int32_t jerk, int32_t clientID) {
   LOGD(TAG, "Motor will move!");
-
-  // save speed and/or acceleration if values differ from known
-  if (_destination_speed != speed || _destination_acceleration != acceleration) {
-    Preferences preferences;
-    preferences.begin("tdrive", false);
-    if (_destination_speed != speed) {
-      preferences.putInt("speed", speed);
-    }
-    if (_destination_acceleration != acceleration) {
-      preferences.putInt("acc", acceleration);
-    }
-    preferences.end();
+  // as requested for retrying after a stall
+  _stallRetry = {true, _stallRetry.count, position, speed, acceleration, jerk};
+  _requested_speed = speed;
+  _requested_acceleration = acceleration;
+  speed = _limitSpeed(speed);
+  acceleration = _limitAcceleration(acceleration);
+
+  // remember speed and/or acceleration if values differ from known (written behind, not while derated)
+  if (_thermalDerating >= 100 && (_configStore.get().speed != speed || _configStore.get().acceleration != acceleration)) {
+    ConfigStore::Config& config = _configStore.edit();
+    config.speed = speed;
+    config.acceleration = acceleration;
   }
 
   _destination_position = position;
   _destination_speed = speed;
-  _destination_acceleration = acceleration;
+  _destination_acceleration = _passResonances(speed, acceleration);
+  _destination_jerk = jerk;
+
+  // a move takes over from jogging
+  if (_jogging) {
+    _jogging = false;
+    _jogWatchdogTask->disable();
+  }
 
   // in which direction is the upcoming movement?
-  if (_destination_position * STEPS_PER_MM > _stepper->getCurrentPosition()) {
+  if (_destination_position * STEPS_PER_MM > _currentPosition()) {
     _movementDirection = MotorDirection::FORWARDS;
   } else {
     _movementDirection = MotorDirection::BACKWARDS;
   }
 
-  // configure FastAccelStepper
-  if (_stepper->setAcceleration(_destination_acceleration * STEPS_PER_MM)) {
+  // jerk limited and shaped moves are planned on the device, yet only from standstill
+  // (otherwise FastAccelStepper's ramp generator takes over)
+  bool started = false;
+  if (_microstepSwitch == MicrostepSwitch::MEASURE || _microstepSwitch == MicrostepSwitch::ALIGN || _microstepSwitch == MicrostepSwitch::SWITCH || _microstepSwitch == MicrostepSwitch::RESTORE) {
+    // switching the µSteps, the destination is taken over when moving on
+    _microstepHalted = false;
+    started = true;
+  } else if ((_destination_jerk > 0 || _planner.isShaping()) && !_stepper->isRunning()) {
+    if (!_startPlanner({{_destination_position * STEPS_PER_MM, static_cast<uint32_t>(_destination_speed * STEPS_PER_MM), static_cast<uint32_t>(_destination_acceleration * STEPS_PER_MM)}}, _destination_jerk * STEPS_PER_MM)) {
+      LOGE(TAG, "Error planning movement!");
+    } else {
+      started = true;
+    }
+  } else if (USTEPS_FAST < USTEPS_PER_STEP && !_stepper->isRunning() && _destination_speed >= USTEPS_FAST_SPEED && _destination_acceleration > 0 &&
+             _destination_speed * _destination_speed / _destination_acceleration <= abs(_destination_position * STEPS_PER_MM - _currentPosition()) / STEPS_PER_MM) {
+    // fast moves (reaching their speed) switch to coarser µSteps, starting on a full step
+    _microstepHalted = false;
+    _microstepAlignments = 0;
+    _microstepMeasure();
+    started = true;
+  } else if (_stepper->setAcceleration(_destination_acceleration * _stepsPerMm())) {
     LOGE(TAG, "Error setting acceleration!");
-    _motorState = MotorState::ERROR;
-    led.setMode(LED::LEDMode::ERROR);
-    // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = stepper.getMotorState_as_string().c_str();
-      jsonMsg["error"] = "Motor won't move";
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
-  } else if (_stepper->setSpeedInMilliHz(_destination_speed * STEPS_PER_MM * 1000)) {
+  } else if (_stepper->setSpeedInMilliHz(_destination_speed * _stepsPerMm() * 1000)) {
     LOGE(TAG, "Error setting speed!");
-    _motorState = MotorState::ERROR;
-    led.setMode(LED::LEDMode::ERROR);
-    // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = stepper.getMotorState_as_string().c_str();
-      jsonMsg["error"] = "Motor won't move";
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
-  } else if (_stepper->moveTo(_destination_position * STEPS_PER_MM)) {
+  } else if (_stepper->moveTo(_destinationSteps())) {
     LOGE(TAG, "Error setting speed!");
+  } else {
+    started = true;
+  }
+
+  if (!started) {
     _motorState = MotorState::ERROR;
-    led.setMode(LED::LEDMode::ERROR);
+    _setLEDMode(LED::LEDMode::ERROR);
     // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = stepper.getMotorState_as_string().c_str();
-      jsonMsg["error"] = "Motor won't move";
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
+    MotorEvent event = _motorStateEvent(_motorState);
+    event.error = "Motor won't move";
+    eventBus.publish(event);
   } else {
     // Update state and create monitoring tasks
     if (_motorState != MotorState::DRIVING) {
-      _motorState = MotorState::DRIVING;
-      led.setMode(LED::LEDMode::DRIVING);
+      _monitorMovement();
+    }
+
+    // send websock event
+    MotorEvent event = _motorStateEvent(_motorState);
+    event.setOrigin(clientID);
+    event.setDestination(_destination_position, _destination_speed, _destination_acceleration, _destination_jerk);
+    eventBus.publish(event);
+  }
+}
+
+// destination in steps of the current MRES (coarse steps stop short of it, the remainder is done with native µSteps)
+int32_t Stepper::_destinationSteps() {
+  int32_t scale = USTEPS_PER_STEP / _microsteps;
+  int32_t microsteps = _destination_position * STEPS_PER_MM - _microstepOffset;
+  int32_t steps = microsteps / scale;
+  if (steps * scale != microsteps) {
+    if (microsteps > 0 && _movementDirection == MotorDirection::BACKWARDS) {
+      steps++;
+    } else if (microsteps < 0 && _movementDirection == MotorDirection::FORWARDS) {
+      steps--;
+    }
+  }
+  return steps;
+}
+
+// change MRES at standstill, the position (µSteps) must be on a step of the new resolution
+void Stepper::_setMicrosteps(uint16_t microsteps, int32_t position) {
+  int32_t scale = USTEPS_PER_STEP / microsteps;
+  _microsteps = microsteps;
+  _microstepOffset = ((position % scale) + scale) % scale;
+  _stepper->forceStopAndNewPosition((position - _microstepOffset) / scale);
+  _stepper_driver.setMicrostepsPerStep(microsteps);
+}
+
+// read MSCNT at standstill, it tells how far the next full step is
+void Stepper::_microstepMeasure() {
+  _microstepSwitch = MicrostepSwitch::MEASURE;
+  _stepper_driver.refresh(TMC2209Driver::REFRESH_MICROSTEPS, [&](bool ok) { _microstepAlign(ok); });
+}
 
-      // update position and speed regularly
-      _checkMovementTask = new Task(MOVEMENT_UPDATE_MS, TASK_FOREVER, [&] { _checkMovementCallback(); }, _scheduler, false, NULL, NULL, true);
-      _checkMovementTask->enableDelayed(MOVEMENT_UPDATE_MS);
+void Stepper::_microstepAlign(bool measured) {
+  if (_microstepSwitch != MicrostepSwitch::MEASURE)
+    return;
+  if (_microstepHalted) {
+    _microstepSwitch = MicrostepSwitch::NONE;
+    return;
+  }
+
+  int32_t position = _stepper->getCurrentPosition();
+  uint16_t mscnt = _stepper_driver.getMicrostepCounter();
+  constexpr int32_t mscntPerMicrostep = MSCNT_PER_FULL_STEP / USTEPS_PER_STEP;
+  // the alignment move tells in which direction MSCNT counts
+  if (measured && _microstepAlignments > 0 && position != _alignedPosition) {
+    uint16_t up = (_alignedMscnt + mscntPerMicrostep * (position - _alignedPosition)) & 0x3FF;
+    uint16_t down = (_alignedMscnt - mscntPerMicrostep * (position - _alignedPosition)) & 0x3FF;
+    _mscntDirection = mscnt == up ? 1 : (mscnt == down ? -1 : 0);
+  }
+
+  if (measured && mscnt % MSCNT_PER_FULL_STEP == MSCNT_FULL_STEP) {
+    // on a full step, every coarse step is a whole number of native µSteps
+    LOGD(TAG, "Switching to %d µSteps at MSCNT %d", USTEPS_FAST, mscnt);
+    _microstepSwitch = MicrostepSwitch::SWITCH;
+    _setMicrosteps(USTEPS_FAST, _currentPosition());
+    _stepper_driver.flush([&](bool) { _microstepStart(); });
+  } else if (measured && mscnt % mscntPerMicrostep == 0 && _microstepAlignments < 2) {
+    // move to the next full step in the direction of the move (guessing the direction of MSCNT until known)
+    int32_t ahead = ((MSCNT_FULL_STEP - mscnt) & (MSCNT_PER_FULL_STEP - 1)) / mscntPerMicrostep;
+    int32_t forward = ((_mscntDirection < 0 ? -ahead : ahead) % USTEPS_PER_STEP + USTEPS_PER_STEP) % USTEPS_PER_STEP;
+    _microstepAlignments++;
+    _alignedPosition = position;
+    _alignedMscnt = mscnt;
+    _microstepSwitch = MicrostepSwitch::ALIGN;
+    _stepper->setAcceleration(_destination_acceleration * STEPS_PER_MM);
+    _stepper->setSpeedInMilliHz(_destination_speed * STEPS_PER_MM * 1000);
+    _stepper->moveTo(position + (_movementDirection == MotorDirection::BACKWARDS ? forward - USTEPS_PER_STEP : forward));
+  } else {
+    LOGW(TAG, "No full step found (MSCNT %d), keeping %d µSteps", mscnt, USTEPS_PER_STEP);
+    _microstepFinish();
+  }
+}
+
+// the driver uses the coarse MRES now
+void Stepper::_microstepStart() {
+  if (_microstepSwitch != MicrostepSwitch::SWITCH)
+    return;
+  if (_microstepHalted) {
+    _microstepRestore();
+    return;
+  }
+  _microstepSwitch = MicrostepSwitch::COARSE;
+  _stepper->setAcceleration(_destination_acceleration * _stepsPerMm());
+  _stepper->setSpeedInMilliHz(_destination_speed * _stepsPerMm() * 1000);
+  _stepper->moveTo(_destinationSteps());
+}
+
+// back to native µSteps at standstill (a coarse step is a whole number of them)
+void Stepper::_microstepRestore() {
+  _microstepSwitch = MicrostepSwitch::RESTORE;
+  _setMicrosteps(USTEPS_PER_STEP, _currentPosition());
+  _stepper_driver.flush([&](bool) {
+    if (_microstepSwitch != MicrostepSwitch::RESTORE)
+      return;
+    if (_microstepHalted || _currentPosition() == _destination_position * STEPS_PER_MM) {
+      _microstepSwitch = MicrostepSwitch::NONE;
+    } else {
+      _microstepFinish();
+    }
+  });
+}
+
+// the (rest of the) move with native µSteps
+void Stepper::_microstepFinish() {
+  _microstepSwitch = MicrostepSwitch::FINISH;
+  _movementDirection = _destination_position * STEPS_PER_MM > _currentPosition() ? MotorDirection::FORWARDS : MotorDirection::BACKWARDS;
+  _stepper->setAcceleration(_destination_acceleration * STEPS_PER_MM);
+  _stepper->setSpeedInMilliHz(_destination_speed * STEPS_PER_MM * 1000);
+  _stepper->moveTo(_destination_position * STEPS_PER_MM);
+}
+
+// FastAccelStepper stopped while switching, false when the move is done
+bool Stepper::_microstepArrived() {
+  switch (_microstepSwitch) {
+    case MicrostepSwitch::NONE:
+      return false;
+    case MicrostepSwitch::ALIGN:
+      if (_microstepHalted) {
+        _microstepSwitch = MicrostepSwitch::NONE;
+        return false;
+      }
+      _microstepMeasure();
+      return true;
+    case MicrostepSwitch::COARSE:
+      _microstepRestore();
+      return true;
+    case MicrostepSwitch::FINISH:
+      _microstepSwitch = MicrostepSwitch::NONE;
+      return false;
+    default:
+      // waiting for the driver
+      return true;
+  }
+}
+
+// plan a path (in steps) and start feeding it into FastAccelStepper's queue
+bool Stepper::_startPlanner(const std::vector<MotionPlanner::Waypoint>& path, uint32_t jerk) {
+  if (!_planner.plan(_stepper->getCurrentPosition(), path, jerk) || !_planner.fill(_stepper)) {
+    _planner.abort();
+    _stepper->forceStop();
+    return false;
+  }
+
+  _plannedMove = true;
+  if (_planner.isActive()) {
+    _movementDirection = _planner.isCountingUp() ? MotorDirection::FORWARDS : MotorDirection::BACKWARDS;
+    // keep the queue filled while moving
+    _feedQueueTask = new Task(PLANNER_FEED_MS, TASK_FOREVER, [&] { _feedQueueCallback(); }, _scheduler, false, NULL, NULL, true);
+    _feedQueueTask->enableDelayed(PLANNER_FEED_MS);
+  }
+  return true;
+}
+
+void Stepper::start_sequence(const std::vector<MotorWaypoint>& waypoints, int32_t jerk, int32_t clientID) {
+  LOGD(TAG, "Motor will move through %d waypoints!", waypoints.size());
+  _stallRetry.valid = false;
+
+  // plan the whole path in steps and fill FastAccelStepper's queue
+  std::vector<MotionPlanner::Waypoint> path;
+  path.reserve(waypoints.size());
+  for (const MotorWaypoint& waypoint : waypoints) {
+    int32_t speed = _limitSpeed(waypoint.speed);
+    int32_t acceleration = _passResonances(speed, _limitAcceleration(waypoint.acceleration));
+    path.push_back({waypoint.position * STEPS_PER_MM, static_cast<uint32_t>(speed) * STEPS_PER_MM, static_cast<uint32_t>(acceleration) * STEPS_PER_MM});
+  }
 
-      _srStandstill.setWaiting();
-      Task* checkStandstillTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _checkStandstillCallback(); }, _scheduler, false, NULL, NULL, true);
-      checkStandstillTask->enable();
-      checkStandstillTask->waitFor(&_srStandstill);
+  if (!_startPlanner(path, jerk * STEPS_PER_MM)) {
+    LOGE(TAG, "Error planning sequence!");
+    _motorState = MotorState::ERROR;
+    _setLEDMode(LED::LEDMode::ERROR);
+    // send websock event
+    MotorEvent event = _motorStateEvent(_motorState);
+    event.error = "Motor won't move";
+    eventBus.publish(event);
+    return;
+  }
+
+  _destination_position = waypoints.back().position;
+  _destination_jerk = jerk;
+
+  // Update state and create monitoring tasks
+  _monitorMovement();
+
+  // send websock event
+  MotorEvent event = _motorStateEvent(_motorState);
+  event.setOrigin(clientID);
+  event.parts |= MotorEvent::WAYPOINTS;
+  event.waypoints = waypoints.size();
+  event.setDestination(_destination_position, waypoints.back().speed, waypoints.back().acceleration, _destination_jerk);
+  eventBus.publish(event);
+}
+
+void Stepper::_feedQueueCallback() {
+  // the home switch stopped the movement, the planner is aborted by the homing-IRQ-task
+  if (_homeLatched)
+    return;
+
+  bool filled = _planner.fill(_stepper);
+  // the ISR might have latched while filling, the commands queued after its stop are dropped
+  if (_homeLatched) {
+    _stepper->forceStop();
+    return;
+  }
+  if (!filled) {
+    LOGE(TAG, "Error filling the motion queue!");
+    _stepper->forceStop();
+    _srStandstill.signalComplete();
+  } else if (_planner.isActive()) {
+    _movementDirection = _planner.isCountingUp() ? MotorDirection::FORWARDS : MotorDirection::BACKWARDS;
+    return;
+  }
+
+  // everything is queued (or the sequence was aborted)
+  _feedQueueTask->disable();
+  _feedQueueTask = nullptr;
+}
+
+void Stepper::_monitorMovement() {
+  _motorState = MotorState::DRIVING;
+  _setLEDMode(LED::LEDMode::DRIVING);
+  _invalidatePosition();
+
+  // update position and speed right away
+  _forceTelemetry();
+
+  // watch for stalls (unless recovering from one)
+  _stallSamples = 0;
+  if (_stallPolicy != StallPolicy::OFF && _stallRecovery == StallRecovery::NONE)
+    _stallMonitorTask->enable();
+
+  // detect the end of the movement without delay
+  _checkArrivalTask = new Task(ARRIVAL_CHECK_MS, TASK_FOREVER, [&] { _checkArrivalCallback(); }, _scheduler, false, NULL, NULL, true);
+  _checkArrivalTask->enableDelayed(ARRIVAL_CHECK_MS);
+
+  _srStandstill.setWaiting();
+  Task* checkStandstillTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _checkStandstillCallback(); }, _scheduler, false, NULL, NULL, true);
+  checkStandstillTask->enable();
+  checkStandstillTask->waitFor(&_srStandstill);
+}
+
+void Stepper::jog(int32_t speed, int32_t acceleration, int32_t clientID) {
+  // stop jogging (with the current acceleration)
+  if (speed == 0) {
+    if (_jogging) {
+      _jogWatchdogTask->disable();
+      _stepper->stopMove();
     }
+    return;
+  }
 
+  // update speed and acceleration on the fly
+  speed = speed < 0 ? -_limitSpeed(-speed) : _limitSpeed(speed);
+  acceleration = _passResonances(abs(speed), _limitAcceleration(acceleration));
+  if (_stepper->setAcceleration(acceleration * STEPS_PER_MM) || _stepper->setSpeedInMilliHz(abs(speed) * STEPS_PER_MM * 1000)) {
+    LOGW(TAG, "Jog parameters unplausible!");
     // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["origin"] = clientID;
-      jsonMsg["state"] = stepper.getMotorState_as_string().c_str();
-      jsonMsg["destination"]["position"] = _destination_position;
-      jsonMsg["destination"]["speed"] = _destination_speed;
-      jsonMsg["destination"]["acceleration"] = _destination_acceleration;
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = "Speed unplausible!";
+    eventBus.publish(event);
+    return;
+  }
+
+  // (re-)start running in the requested direction, reversing is handled by FastAccelStepper
+  MotorDirection direction = speed > 0 ? MotorDirection::FORWARDS : MotorDirection::BACKWARDS;
+  if (!_jogging || direction != _movementDirection || _stepper->isStopping()) {
+    _movementDirection = direction;
+    if (direction == MotorDirection::FORWARDS) {
+      _stepper->runForward();
+    } else {
+      _stepper->runBackward();
     }
+  } else {
+    _stepper->applySpeedAcceleration();
+  }
+
+  // refresh the deadman timeout
+  _jogWatchdogTask->restartDelayed(_jogTimeout);
+
+  if (!_jogging) {
+    LOGD(TAG, "Motor starts jogging!");
+    _jogging = true;
+    _stallRetry.valid = false;
+    _destination_speed = abs(speed);
+    _monitorMovement();
+
+    // send websock event
+    MotorEvent event = _motorStateEvent(_motorState);
+    event.setOrigin(clientID);
+    event.parts |= MotorEvent::JOG;
+    event.jog = {speed, acceleration};
+    eventBus.publish(event);
+  }
+}
+
+// no jog command received in time, ramp down
+void Stepper::_jogWatchdogCallback() {
+  if (_jogging) {
+    LOGW(TAG, "Jog timed out!");
+    _stepper->stopMove();
   }
 }
 
@@ -763,82 +2535,317 @@ void Stepper::halt_move() {
   LOGD(TAG, "Motor will stop!");
 
   // bring the motor to halt now
-  _stepper->setAcceleration(1600 * STEPS_PER_MM);
-  _stepper->applySpeedAcceleration();
-  _stepper->stopMove();
+  if (_planner.isActive()) {
+    _planner.stop(_stepper, 1600 * _stepsPerMm());
+  } else {
+    _stepper->setAcceleration(1600 * _stepsPerMm());
+    _stepper->applySpeedAcceleration();
+    _stepper->stopMove();
+  }
   _movementDirection = MotorDirection::STANDSTILL;
+  _stallRecovery = StallRecovery::NONE;
+  if (_stallHoming != StallHoming::NONE)
+    _endStallHoming();
+  _switchHoming = SwitchHoming::NONE;
+  _homingCheckTask->disable();
+  if (_characterization.phase != Characterization::NONE)
+    _characterizeEnd();
+  if (_shaperCalibration.active)
+    _shaperCalibrateEnd();
 
   // Forcefully stop driving operation
   if (_motorState == MotorState::DRIVING) {
     LOGD(TAG, "Driving Cancelled!");
-    _srStandstill.signalComplete();
+    if (_microstepSwitch == MicrostepSwitch::NONE) {
+      _srStandstill.signalComplete();
+    } else {
+      // native µSteps are restored first (see _checkArrivalCallback)
+      _microstepHalted = true;
+    }
   } else {
     LOGD(TAG, "Movement Cancelled!");
     _motorState = MotorState::IDLE;
-    led.setMode(LED::LEDMode::IDLE);
-    _destination_position = _stepper->getCurrentPosition() / STEPS_PER_MM;
+    _setLEDMode(LED::LEDMode::IDLE);
+    _destination_position = _currentPosition() / STEPS_PER_MM;
 
     // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = MotorState_string_map[MotorState::STOPPED].c_str();
-      jsonMsg["move_state"]["position"] = _destination_position;
-      jsonMsg["move_state"]["speed"] = 0;
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
+    MotorEvent event = _motorStateEvent(MotorState::STOPPED);
+    event.setMoveState(_destination_position, 0, _telemetryCurrentScale);
+    eventBus.publish(event);
   }
 }
 
 void Stepper::do_homing() {
   LOGD(TAG, "Motor will go/find home!");
 
-  // Check if we are already at home position
+  // home at the hard stop instead of the switch
+  if (_homingMode != HomingMode::SWITCH) {
+    _startStallHoming();
+    return;
+  }
+
+  _motorState = MotorState::HOMING;
+  _setLEDMode(LED::LEDMode::HOMING);
+
+  // send websock event
+  MotorEvent event = _motorStateEvent(_motorState);
+  event.setMoveState(0, HOMING_FAST_SPEED / STEPS_PER_MM / 1000, _telemetryCurrentScale);
+  eventBus.publish(event);
+
+  LOGI(TAG, "Start Regular Homing");
+  _startSwitchHoming();
+}
+
+// fast to the switch (or before the known home) and slowly re-approaching it
+void Stepper::_startSwitchHoming() {
+  _invalidatePosition();
+  _homingBackOffs = 0;
+  _homingCheckTask->enable();
   if (!digitalRead(TMC_HOME)) {
-    LOGI(TAG, "Homing not required - already there!");
-    // Set position to 0 anyways...
-    _movementDirection = MotorDirection::STANDSTILL;
-    _stepper->setCurrentPosition(-STEPS_PER_MM / 2);
-    _stepper->setAcceleration(HOMING_ACCELERATION);
-    _stepper->setSpeedInMilliHz(HOMING_SPEED);
-    _stepper->moveTo(0);
-    _homed = true;
-    _destination_position = 0;
-    _motorState = MotorState::IDLE;
-    led.setMode(LED::LEDMode::IDLE);
+    // already at the switch, only re-approach slowly
+    _startBackOff();
+  } else if (_homed) {
+    // move fast to just before the known home
+    int32_t creepPosition = HOMING_CREEP_MM * STEPS_PER_MM;
+    _switchHoming = SwitchHoming::PRE_POSITION;
+    _movementDirection = creepPosition < _stepper->getCurrentPosition() ? MotorDirection::BACKWARDS : MotorDirection::FORWARDS;
+    _stepper->setAcceleration(HOMING_FAST_ACCELERATION);
+    _stepper->setSpeedInMilliHz(HOMING_FAST_SPEED);
+    _stepper->moveTo(creepPosition);
+  } else {
+    // move fast toward the homing button
+    _switchHoming = SwitchHoming::APPROACH;
+    _movementDirection = MotorDirection::BACKWARDS;
+    _stepper->setAcceleration(HOMING_FAST_ACCELERATION);
+    _stepper->setSpeedInMilliHz(HOMING_FAST_SPEED);
+    _stepper->runBackward();
+  }
+}
 
-    // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = MotorState_string_map[MotorState::HOMED].c_str();
-      jsonMsg["move_state"]["position"] = 0;
-      jsonMsg["move_state"]["speed"] = 0;
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
+// move away from the switch (the following re-approach starts when done)
+void Stepper::_startBackOff() {
+  _switchHoming = SwitchHoming::BACK_OFF;
+  _movementDirection = MotorDirection::FORWARDS;
+  _stepper->setAcceleration(HOMING_ACCELERATION);
+  _stepper->setSpeedInMilliHz(HOMING_SPEED);
+  _stepper->move(HOMING_BACKOFF_MM * STEPS_PER_MM);
+}
+
+// approach the switch slowly, the home position is taken when hitting it
+void Stepper::_startCreep() {
+  // the switch only signals being pressed, it must be released first
+  if (!digitalRead(TMC_HOME)) {
+    if (++_homingBackOffs < 3) {
+      _startBackOff();
+      return;
     }
-  } else {
-    _motorState = MotorState::HOMING;
-    led.setMode(LED::LEDMode::HOMING);
+    LOGW(TAG, "Home switch not released!");
+    halt_move();
 
     // send websock event
-    if (_motorEventCallback != nullptr) {
-      JsonDocument jsonMsg;
-      jsonMsg["type"] = "motor_state";
-      jsonMsg["state"] = stepper.getMotorState_as_string().c_str();
-      jsonMsg["move_state"]["position"] = 0;
-      jsonMsg["move_state"]["speed"] = 33;
-      jsonMsg.shrinkToFit();
-      _motorEventCallback(jsonMsg);
-    }
-
-    LOGI(TAG, "Start Regular Homing");
-    // move at 250 rpm toward the homing button
+    MotorEvent event = _motorStateEvent(MotorState::WARNING);
+    event.warning = "Home switch stuck!";
+    eventBus.publish(event);
+    return;
+  }
+  _switchHoming = SwitchHoming::CREEP;
+  _movementDirection = MotorDirection::BACKWARDS;
+  _stepper->setAcceleration(HOMING_ACCELERATION);
+  _stepper->setSpeedInMilliHz(HOMING_CREEP_SPEED);
+  _stepper->runBackward();
+}
+
+void Stepper::_startStallHoming() {
+  _motorState = MotorState::HOMING;
+  _setLEDMode(LED::LEDMode::HOMING);
+
+  // send websock event
+  MotorEvent event = _motorStateEvent(_motorState);
+  event.setMoveState(0, STALL_HOMING_SPEED / STEPS_PER_MM / 1000, _telemetryCurrentScale);
+  eventBus.publish(event);
+
+  LOGI(TAG, "Start Sensorless Homing");
+  _invalidatePosition();
+  // StallGuard only works in StealthChop, DIAG signals a stall above TCOOLTHRS
+  _stepper_driver.setStealthChopDurationThreshold(0);
+  _stepper_driver.setCoolStepDurationThreshold(0xFFFFF);
+  _stepper_driver.disableCoolStep();
+  _stepper_driver.setStallGuardThreshold(_stallThreshold);
+  _stallHoming = StallHoming::HOME;
+  _homingCheckTask->enable();
+
+  // move fast toward the hard stop once StallGuard is set up
+  _stepper_driver.flush([&](bool) {
+    if (_stallHoming != StallHoming::HOME)
+      return;
     _movementDirection = MotorDirection::BACKWARDS;
+    _stepper->setAcceleration(STALL_HOMING_ACCELERATION);
+    _stepper->setSpeedInMilliHz(STALL_HOMING_SPEED);
+    _stepper->runBackward();
+  });
+}
+
+void Stepper::_homingCheckCallback() {
+  if (_switchHoming == SwitchHoming::PRE_POSITION || _switchHoming == SwitchHoming::BACK_OFF) {
+    // re-approach when arrived
+    if (!_stepper->isRunning())
+      _startCreep();
+  } else if (_stallHoming == StallHoming::RETURN) {
+    if (!_stepper->isRunning())
+      _finishStallHoming();
+  } else if (_stallHoming != StallHoming::NONE) {
+    // DIAG only signals the rising edge, also catch a stall which started while accelerating
+    if ((_stepper->rampState() & RAMP_STATE_MASK) == RAMP_STATE_COAST && digitalRead(TMC_DIAG))
+      _stallDetected();
+  }
+}
+
+// the hard stop was hit
+void Stepper::_stallDetected() {
+  if (_stallHoming == StallHoming::HOME) {
+    LOGI(TAG, "Hit hard stop while homing");
+    // same safety margin as with the home switch
+    _planner.abort();
+    _stepper->forceStopAndNewPosition(-STEPS_PER_MM / 2);
+    _homed = true;
+    _destination_position = 0;
+
+    // measure the stroke up to the other end
+    if (_homingMode == HomingMode::STALLGUARD_BOTH_ENDS) {
+      _stallHoming = StallHoming::FAR_END;
+      _movementDirection = MotorDirection::FORWARDS;
+      _stepper->runForward();
+      return;
+    }
+    // back off to home, homing is finished when arrived
+    _endStallHoming();
+    _stallHoming = StallHoming::RETURN;
+    _homingCheckTask->enable();
+    _movementDirection = MotorDirection::FORWARDS;
     _stepper->setAcceleration(HOMING_ACCELERATION);
     _stepper->setSpeedInMilliHz(HOMING_SPEED);
-    _stepper->runBackward();
+    _stepper->moveTo(0);
+  } else if (_stallHoming == StallHoming::FAR_END) {
+    // keep the same margin at the other end
+    int32_t strokeLength = (_stepper->getCurrentPosition() - STEPS_PER_MM / 2) / STEPS_PER_MM;
+    _stepper->forceStop();
+    LOGI(TAG, "Hit hard stop at the other end, stroke length: %d mm", strokeLength);
+    if (_strokeLength != strokeLength) {
+      _strokeLength = strokeLength;
+      _configStore.edit().strokeLength = _strokeLength;
+    }
+
+    // send websock event
+    eventBus.publish(configEvent());
+
+    // go back home, homing is finished when arrived
+    _endStallHoming();
+    _stallHoming = StallHoming::RETURN;
+    _homingCheckTask->enable();
+    _movementDirection = MotorDirection::BACKWARDS;
+    _stepper->setAcceleration(STALL_HOMING_ACCELERATION);
+    _stepper->setSpeedInMilliHz(STALL_HOMING_SPEED);
+    _stepper->moveTo(0);
+  }
+}
+
+// back to the thresholds of regular operation
+void Stepper::_endStallHoming() {
+  _stallHoming = StallHoming::NONE;
+  _homingCheckTask->disable();
+  _stepper_driver.setStallGuardThreshold(0);
+  _applyChopperMode();
+  _stepper_driver.flush();
+}
+
+void Stepper::_finishStallHoming() {
+  _stallHoming = StallHoming::NONE;
+  _homingCheckTask->disable();
+  _movementDirection = MotorDirection::STANDSTILL;
+  _motorState = MotorState::IDLE;
+  _setLEDMode(LED::LEDMode::IDLE);
+
+  // send websock event
+  MotorEvent event = _motorStateEvent(MotorState::HOMED);
+  event.setMoveState(0, 0, _telemetryCurrentScale);
+  eventBus.publish(event);
+}
+
+void Stepper::_stallMonitorCallback() {
+  switch (_stallRecovery) {
+    case StallRecovery::STOPPING:
+      // home again from standstill
+      if (_motorState == MotorState::IDLE && !_stepper->isRunning()) {
+        _stallRecovery = StallRecovery::HOMING;
+        do_homing();
+      }
+      return;
+
+    case StallRecovery::HOMING:
+      if (_motorState == MotorState::HOMING)
+        return;
+      _stallRecovery = StallRecovery::NONE;
+      _stallMonitorTask->disable();
+      // retry the move (the count is kept)
+      if (_homed && _motorState == MotorState::IDLE && _stallPolicy == StallPolicy::RETRY && _stallRetry.valid && _stallRetry.count < STALL_RETRIES) {
+        _stallRetry.count++;
+        LOGI(TAG, "Retrying the move to %d mm (%d. time)", _stallRetry.position, _stallRetry.count);
+        start_move(_stallRetry.position, _stallRetry.speed, _stallRetry.acceleration, _stallRetry.jerk);
+      }
+      return;
+
+    default:
+      break;
+  }
+
+  if (_motorState != MotorState::DRIVING) {
+    _stallMonitorTask->disable();
+    return;
+  }
+  // sample the load (one batch at a time)
+  if (!_stallSampling) {
+    _stallSampling = true;
+    _stepper_driver.refresh(TMC2209Driver::REFRESH_LOAD | TMC2209Driver::REFRESH_DRIVER_STATUS, [&](bool ok) {
+      _stallSampling = false;
+      if (ok)
+        _checkStall();
+    });
+  }
+}
+
+// StallGuard is only valid in StealthChop with some velocity, SG_RESULT rises with the speed (back-EMF),
+// so the threshold of sensorless homing (stalling below twice SGTHRS) is scaled from the homing speed
+void Stepper::_checkStall() {
+  int32_t speed = abs(_currentSpeedInMilliHz()) / STEPS_PER_MM / 1000;
+  if (_motorState != MotorState::DRIVING || _stallRecovery != StallRecovery::NONE || !_stepper_driver.getStatus().stealth_chop_mode || speed < STALL_MONITOR_SPEED_MIN) {
+    _stallSamples = 0;
+    return;
+  }
+  uint32_t threshold = min(static_cast<uint32_t>(2 * _stallThreshold * speed / (STALL_HOMING_SPEED / STEPS_PER_MM / 1000)), static_cast<uint32_t>(510));
+  if (_stepper_driver.getStallGuardResult() >= threshold) {
+    _stallSamples = 0;
+  } else if (++_stallSamples >= STALL_MONITOR_SAMPLES) {
+    LOGW(TAG, "Stall at %d mm/s (SG_RESULT: %d, threshold: %d)", speed, _stepper_driver.getStallGuardResult(), threshold);
+    _stallWhileMoving();
+  }
+}
+
+// the steps went on without the rotor, the position can't be trusted anymore
+void Stepper::_stallWhileMoving() {
+  _stallSamples = 0;
+  halt_move();
+  _homed = false;
+
+  // send websock event
+  MotorEvent event = _motorStateEvent(MotorState::WARNING);
+  event.warning = "Stall detected, homing needed!";
+  eventBus.publish(event);
+
+  // recover from standstill (see _stallMonitorCallback)
+  if (_stallPolicy == StallPolicy::REHOME || _stallPolicy == StallPolicy::RETRY) {
+    _stallRecovery = StallRecovery::STOPPING;
+  } else {
+    _stallMonitorTask->disable();
   }
 }
 
@@ -852,49 +2859,99 @@ std::string Stepper::getHomingState_as_string() {
   }
 }
 
+void Stepper::_forceTelemetry() {
+  _telemetryForced = true;
+  if (_checkMovementTask != nullptr)
+    _checkMovementTask->restart();
+}
+
 void Stepper::_checkMovementCallback() {
-  // Get current position
-  int32_t position = _stepper->getCurrentPosition() / STEPS_PER_MM;
+  // Get current position, speed and state of the ramp
+  int32_t position = _currentPosition() / STEPS_PER_MM;
+  int32_t speed = _currentSpeedInMilliHz() / STEPS_PER_MM / 1000;
+  uint8_t rampState = _stepper->rampState() & RAMP_STATE_MASK;
+  // CS_ACTUAL is read while moving (otherwise with the periodic check of the driver)
+  uint8_t currentScale = _stepper_driver.getStatus().current_scaling;
+  if (_stepper->isRunning() && !_currentSampling) {
+    _currentSampling = true;
+    _stepper_driver.refresh(TMC2209Driver::REFRESH_DRIVER_STATUS, [&](bool) { _currentSampling = false; });
+  }
 
-  // send websock event
-  if (_motorEventCallback != nullptr) {
-    JsonDocument jsonMsg;
-    jsonMsg["type"] = "move_state";
-    jsonMsg["position"] = position;
-    jsonMsg["speed"] = _stepper->getCurrentSpeedInMilliHz() / STEPS_PER_MM / 1000;
-    jsonMsg.shrinkToFit();
-    _motorEventCallback(jsonMsg);
+  // send on transitions of the ramp or if the change exceeds the deadband
+  if (_telemetryForced || rampState != _telemetryRampState || currentScale != _telemetryCurrentScale || static_cast<uint32_t>(abs(position - _telemetryPosition)) > _positionDeadband ||
+      static_cast<uint32_t>(abs(speed - _telemetrySpeed)) > _speedDeadband) {
+    _telemetryForced = false;
+    _telemetryPosition = position;
+    _telemetrySpeed = speed;
+    _telemetryRampState = rampState;
+    _telemetryCurrentScale = currentScale;
+
+    // send websock event
+    MotorEvent event = {};
+    event.type = MotorEvent::Type::MOVE_STATE;
+    event.setMoveState(position, speed, currentScale);
+    eventBus.publish(event);
+  }
+
+  // update often while accelerating, less at cruise and rarely at standstill
+  // (moves fed by the planner don't use the ramp generator, so look at the speed as well)
+  uint32_t interval = TELEMETRY_IDLE_MS;
+  if ((rampState & (RAMP_STATE_ACCELERATING_FLAG | RAMP_STATE_DECELERATING_FLAG)) || speed != _sampledSpeed) {
+    interval = TELEMETRY_RAMP_MS;
+  } else if (_stepper->isRunning()) {
+    interval = MOVEMENT_UPDATE_MS;
   }
+  _sampledSpeed = speed;
+  if (_chopperModeRestore && !_stepper->isRunning() && _motorState == MotorState::IDLE)
+    _selectChopperMode(ChopperMode::AUTO);
+  if (_checkMovementTask->getInterval() != interval)
+    _checkMovementTask->setInterval(interval);
+}
 
-  // if current position equals the destination we're done
-  if (position == _destination_position) {
+void Stepper::_checkArrivalCallback() {
+  // the ramp (or the planned sequence) has finished when the queue ran empty
+  // (sequences might run the queue empty only after everything is queued)
+  if (!_stepper->isRunning() && !_planner.isActive()) {
+    // a move switching the µSteps goes on
+    if (_microstepArrived())
+      return;
     LOGD(TAG, "Movement Done!");
     _srStandstill.signalComplete();
+  } else {
+    // reduced current at cruise (planned moves don't use the ramp generator)
+    _scheduleCurrent(_motorState == MotorState::DRIVING && !_planner.isActive() && (_stepper->rampState() & RAMP_STATE_MASK) == RAMP_STATE_COAST);
   }
 }
 
 void Stepper::_checkStandstillCallback() {
-  if (_checkMovementTask != nullptr) {
-    _checkMovementTask->disable();
-    _checkMovementTask = nullptr;
+  if (_checkArrivalTask != nullptr) {
+    _checkArrivalTask->disable();
+    _checkArrivalTask = nullptr;
   }
 
   // Handle case of premature stopping
-  _destination_position = _stepper->getCurrentPosition() / STEPS_PER_MM;
+  _destination_position = _currentPosition() / STEPS_PER_MM;
 
   // send websock event
-  if (_motorEventCallback != nullptr) {
-    JsonDocument jsonMsg;
-    jsonMsg["type"] = "motor_state";
-    jsonMsg["state"] = MotorState_string_map[MotorState::STOPPED].c_str();
-    jsonMsg["move_state"]["position"] = _destination_position;
-    jsonMsg["move_state"]["speed"] = 0;
-    jsonMsg["destination"]["position"] = _destination_position;
-    jsonMsg.shrinkToFit();
-    _motorEventCallback(jsonMsg);
-  }
-
+  MotorEvent event = _motorStateEvent(MotorState::STOPPED);
+  event.setMoveState(_destination_position, 0, _telemetryCurrentScale);
+  event.setDestination(_destination_position, _destination_speed, _destination_acceleration, _destination_jerk);
+  eventBus.publish(event);
+  // telemetry at standstill was just sent
+  _telemetryPosition = _destination_position;
+  _telemetrySpeed = 0;
+
+  _plannedMove = false;
+  _jogging = false;
+  _jogWatchdogTask->disable();
   _movementDirection = MotorDirection::STANDSTILL;
   _motorState = MotorState::IDLE;
-  led.setMode(LED::LEDMode::IDLE);
+  _setLEDMode(LED::LEDMode::IDLE);
+  // a per-move chopper mode ends with the move, the next one starts boosted
+  // (a halted move might still decelerate, see _checkMovementCallback)
+  _selectChopperMode(ChopperMode::AUTO);
+  _chopperModeRestore = _chopperMode != ChopperMode::AUTO;
+  _scheduleCurrent(false);
+  if (_stallRecovery == StallRecovery::NONE)
+    _stallMonitorTask->disable();
 }
@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+
+#include <TMC2209Driver.h>
+
+#define SYNC_BYTE 0x05
+#define MASTER_ADDRESS 0xFF
+#define WRITE_BIT 0x80
+#define DATAGRAM_SIZE 8
+#define READ_REQUEST_SIZE 4
+#define VERSION 0x21
+
+// status registers
+#define ADDRESS_GCONF 0x00
+#define ADDRESS_GSTAT 0x01
+#define ADDRESS_IOIN 0x06
+#define ADDRESS_TSTEP 0x12
+#define ADDRESS_SG_RESULT 0x41
+#define ADDRESS_MSCNT 0x6A
+#define ADDRESS_DRV_STATUS 0x6F
+#define ADDRESS_PWM_SCALE 0x71
+#define ADDRESS_PWM_AUTO 0x72
+
+const uint8_t TMC2209Driver::SHADOW_ADDRESS[SHADOW_COUNT] = {0x00, 0x10, 0x11, 0x13, 0x14, 0x40, 0x42, 0x6C, 0x70};
+
+// serial operation (pdn_disable, mstep_reg_select, multistep_filt), no current,
+// CHOPCONF and PWMCONF reset defaults with the driver disabled (toff = 0)
+const uint32_t TMC2209Driver::SHADOW_DEFAULT[SHADOW_COUNT] = {0x000001C0, 0x00010000, 20, 0, 0, 0, 0, 0x10000050, 0xC10D0024};
+
+void TMC2209Driver::begin(Scheduler* scheduler) {
+  // Task handling
+  _scheduler = scheduler;
+  _srReceive.setWaiting();
+
+  // create and run a task for handling the transactions (woken up by received data)
+  _transactionTask = new Task(TASK_IMMEDIATE, TASK_FOREVER, [&] { _transactionCallback(); }, _scheduler, false, NULL, NULL, true);
+  _transactionTask->enable();
+  _transactionTask->waitFor(&_srReceive);
+
+  // create a (stopped) task for waking up the transaction-task when a reply is overdue
+  _timeoutTask = new Task(TASK_IMMEDIATE, TASK_ONCE, [&] { _isrReceive(); }, _scheduler, false);
+}
+
+void TMC2209Driver::end() {
+  // end the transaction-task
+  if (_transactionTask != nullptr) {
+    _transactionTask->disable();
+    _transactionTask = nullptr;
+  }
+  if (_timeoutTask != nullptr) {
+    _timeoutTask->disable();
+    delete _timeoutTask;
+    _timeoutTask = nullptr;
+  }
+
+  // e.g. disabling the driver should still get through
+  for (const Transaction& transaction : _transactions) {
+    if (transaction.type == TransactionType::WRITE)
+      _sendWrite(transaction.address, transaction.value);
+  }
+  if (_serial != nullptr)
+    _serial->flush();
+  _transactions.clear();
+  _waiting = false;
+}
+
+void TMC2209Driver::setup(HardwareSerial& serial, uint32_t baud, SerialAddress address, int16_t rx, int16_t tx) {
+  _serial = &serial;
+  _address = address;
+  _serial->begin(baud, SERIAL_8N1, rx, tx);
+  _serial->onReceive([&] { _isrReceive(); });
+
+  // a read in progress belongs to the previous setup
+  _transactions.clear();
+  _waiting = false;
+
+  // nothing is written yet, a driver holding the motor stays untouched until the first flush
+  memcpy(_shadow, SHADOW_DEFAULT, sizeof(_shadow));
+  invalidate();
+  _snapshot = {};
+}
+
+void TMC2209Driver::flush(Callback done) {
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>(Batch{true, done});
+  for (uint8_t reg = 0; reg < SHADOW_COUNT; reg++) {
+    if (_dirty & (1 << reg))
+      _enqueue(TransactionType::WRITE, SHADOW_ADDRESS[reg], _shadow[reg], batch);
+  }
+  _dirty = 0;
+  _enqueue(TransactionType::COMPLETE, 0, 0, batch);
+}
+
+void TMC2209Driver::refresh(uint8_t registers, Callback done) {
+  // a missing answer means the driver is gone (probably lost power)
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>(Batch{true, [this, done](bool ok) {
+                                                                 _snapshot.timestamp = millis();
+                                                                 if (!ok) {
+                                                                   _snapshot.communicating = false;
+                                                                   _snapshot.setup = false;
+                                                                 }
+                                                                 if (done)
+                                                                   done(ok);
+                                                               }});
+  if (registers & REFRESH_COMMUNICATION) {
+    _enqueue(TransactionType::READ, ADDRESS_IOIN, 0, batch);
+    _enqueue(TransactionType::READ, ADDRESS_GCONF, 0, batch);
+  }
+  if (registers & REFRESH_GLOBAL_STATUS)
+    _enqueue(TransactionType::READ, ADDRESS_GSTAT, 0, batch);
+  if (registers & REFRESH_DRIVER_STATUS)
+    _enqueue(TransactionType::READ, ADDRESS_DRV_STATUS, 0, batch);
+  if (registers & REFRESH_PWM) {
+    _enqueue(TransactionType::READ, ADDRESS_PWM_SCALE, 0, batch);
+    _enqueue(TransactionType::READ, ADDRESS_PWM_AUTO, 0, batch);
+  }
+  if (registers & REFRESH_LOAD) {
+    _enqueue(TransactionType::READ, ADDRESS_SG_RESULT, 0, batch);
+    _enqueue(TransactionType::READ, ADDRESS_TSTEP, 0, batch);
+  }
+  if (registers & REFRESH_MICROSTEPS)
+    _enqueue(TransactionType::READ, ADDRESS_MSCNT, 0, batch);
+  _enqueue(TransactionType::COMPLETE, 0, 0, batch);
+}
+
+void TMC2209Driver::clearReset() {
+  _enqueue(TransactionType::WRITE, ADDRESS_GSTAT, 1, std::make_shared<Batch>(Batch{true, nullptr}));
+  _snapshot.globalStatus.reset = 0;
+}
+
+void TMC2209Driver::enable() {
+  _setBits(CHOPCONF, 0xF, 0, _toff);
+}
+
+void TMC2209Driver::disable() {
+  _setBits(CHOPCONF, 0xF, 0, 0);
+}
+
+void TMC2209Driver::setMicrostepsPerStep(uint16_t microstepsPerStep) {
+  // MRES: 0 --> 256 µSteps ... 8 --> full steps (rounded down to a power of 2)
+  uint8_t exponent = 0;
+  while (exponent < 8 && (1U << (exponent + 1)) <= microstepsPerStep)
+    exponent++;
+  _setBits(CHOPCONF, 0xF, 24, 8 - exponent);
+}
+
+// same scaling as TMCStepper and janelia's TMC2209 library
+void TMC2209Driver::setRMSCurrent(uint16_t mA, float rSense, float holdMultiplier) {
+  float cs = 32.0f * 1.41421f * mA / 1000.0f * (rSense + 0.02f) / 0.325f - 1.0f;
+  uint8_t vsense = 0;
+  // use the higher sensitivity for low currents
+  if (cs < 16.0f) {
+    vsense = 1;
+    cs = 32.0f * 1.41421f * mA / 1000.0f * (rSense + 0.02f) / 0.180f - 1.0f;
+  }
+  uint8_t irun = constrain(static_cast<int>(cs), 0, 31);
+  uint8_t ihold = constrain(static_cast<int>(irun * holdMultiplier), 0, 31);
+  _setBits(CHOPCONF, 1, 17, vsense);
+  _setBits(IHOLD_IRUN, 0x1F, 0, ihold);
+  _setBits(IHOLD_IRUN, 0x1F, 8, irun);
+}
+
+void TMC2209Driver::enableCoolStep(uint8_t lowerThreshold, uint8_t upperThreshold) {
+  _setBits(COOLCONF, 0xF, 0, lowerThreshold);
+  _setBits(COOLCONF, 0xF, 8, upperThreshold);
+}
+
+void TMC2209Driver::_setBits(Shadow reg, uint32_t mask, uint8_t shift, uint32_t value) {
+  uint32_t updated = (_shadow[reg] & ~(mask << shift)) | ((value & mask) << shift);
+  if (updated != _shadow[reg]) {
+    _shadow[reg] = updated;
+    _dirty |= 1 << reg;
+  }
+}
+
+// CRC8 (polynomial 0x07), bits are processed LSB first
+uint8_t TMC2209Driver::_crc(const uint8_t* datagram, size_t length) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; i++) {
+    uint8_t byte = datagram[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      if ((crc >> 7) ^ (byte & 0x01)) {
+        crc = (crc << 1) ^ 0x07;
+      } else {
+        crc = crc << 1;
+      }
+      byte >>= 1;
+    }
+  }
+  return crc;
+}
+
+void TMC2209Driver::_enqueue(TransactionType type, uint8_t address, uint32_t value, const std::shared_ptr<Batch>& batch) {
+  _transactions.push_back({type, address, value, batch});
+
+  // wake up the transaction-task
+  if (!_waiting)
+    _isrReceive();
+}
+
+void TMC2209Driver::_transactionCallback() {
+  // (data received while handling the transactions will trigger the next run)
+  _srReceive.setWaiting();
+
+  while (!_transactions.empty()) {
+    Transaction& transaction = _transactions.front();
+    if (transaction.type == TransactionType::WRITE) {
+      _sendWrite(transaction.address, transaction.value);
+    } else if (transaction.type == TransactionType::READ && transaction.batch->ok) {
+      uint32_t value = 0;
+      if (!_waiting) {
+        // wait for the reply (or the timeout)
+        _sendRead(transaction.address);
+        _timeoutTask->restartDelayed(DRIVER_REPLY_TIMEOUT_MS);
+        break;
+      } else if (_receiveReply(transaction.address, &value)) {
+        _store(transaction.address, value);
+      } else if (millis() - _sentAt < DRIVER_REPLY_TIMEOUT_MS) {
+        break;
+      } else {
+        _readErrors++;
+        _waiting = false;
+        if (++_attempt < DRIVER_READ_RETRIES)
+          continue;
+        // skip the remaining reads of this batch
+        transaction.batch->ok = false;
+      }
+    }
+
+    // done with this one (the callback might queue further transactions)
+    std::shared_ptr<Batch> batch = transaction.batch;
+    bool complete = transaction.type == TransactionType::COMPLETE;
+    _transactions.pop_front();
+    _waiting = false;
+    _attempt = 0;
+    if (complete && batch->done)
+      batch->done(batch->ok);
+  }
+
+  // Wait for the next event...
+  _transactionTask->waitFor(&_srReceive);
+}
+
+void TMC2209Driver::_store(uint8_t address, uint32_t value) {
+  switch (address) {
+    case ADDRESS_IOIN:
+      _snapshot.communicating = (value >> 24) == VERSION;
+      break;
+    case ADDRESS_GCONF:
+      _snapshot.setup = value & (1 << 6);
+      break;
+    case ADDRESS_GSTAT:
+      memcpy(&_snapshot.globalStatus, &value, sizeof(value));
+      break;
+    case ADDRESS_DRV_STATUS:
+      memcpy(&_snapshot.status, &value, sizeof(value));
+      break;
+    case ADDRESS_PWM_SCALE: {
+      _snapshot.pwmScaleSum = value & 0xFF;
+      // 9 bit signed
+      int16_t scaleAuto = (value >> 16) & 0x1FF;
+      _snapshot.pwmScaleAuto = (scaleAuto & 0x100) ? scaleAuto - 0x200 : scaleAuto;
+      break;
+    }
+    case ADDRESS_PWM_AUTO:
+      _snapshot.pwmOffsetAuto = value & 0xFF;
+      _snapshot.pwmGradientAuto = (value >> 16) & 0xFF;
+      break;
+    case ADDRESS_SG_RESULT:
+      _snapshot.stallGuardResult = value & 0x3FF;
+      break;
+    case ADDRESS_TSTEP:
+      _snapshot.interstepDuration = value & 0xFFFFF;
+      break;
+    case ADDRESS_MSCNT:
+      _snapshot.microstepCounter = value & 0x3FF;
+      break;
+  }
+}
+
+// the datagram fits into the UART's FIFO, nothing waits for it being sent
+void TMC2209Driver::_sendWrite(uint8_t address, uint32_t value) {
+  if (_serial == nullptr)
+    return;
+  uint8_t datagram[DATAGRAM_SIZE] = {SYNC_BYTE, _address, static_cast<uint8_t>(address | WRITE_BIT), static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value), 0};
+  datagram[DATAGRAM_SIZE - 1] = _crc(datagram, DATAGRAM_SIZE - 1);
+  _serial->write(datagram, DATAGRAM_SIZE);
+}
+
+void TMC2209Driver::_sendRead(uint8_t address) {
+  _waiting = true;
+  _received = 0;
+  _sentAt = millis();
+  if (_serial == nullptr)
+    return;
+
+  // drop echoes of previous datagrams (single-wire) and garbage
+  while (_serial->available())
+    _serial->read();
+  uint8_t request[READ_REQUEST_SIZE] = {SYNC_BYTE, _address, address, 0};
+  request[READ_REQUEST_SIZE - 1] = _crc(request, READ_REQUEST_SIZE - 1);
+  _serial->write(request, READ_REQUEST_SIZE);
+}
+
+// collect the reply, the echo of the request is skipped by syncing on the master address
+bool TMC2209Driver::_receiveReply(uint8_t address, uint32_t* value) {
+  while (_serial != nullptr && _serial->available() && _received < DATAGRAM_SIZE) {
+    uint8_t byte = _serial->read();
+    if (_received == 0 && byte != SYNC_BYTE)
+      continue;
+    if (_received == 1 && byte != MASTER_ADDRESS) {
+      _received = byte == SYNC_BYTE ? 1 : 0;
+      continue;
+    }
+    _reply[_received++] = byte;
+  }
+  if (_received < DATAGRAM_SIZE)
+    return false;
+
+  // start over on a broken datagram (until the timeout)
+  if (_reply[2] != address || _reply[DATAGRAM_SIZE - 1] != _crc(_reply, DATAGRAM_SIZE - 1)) {
+    _received = 0;
+    return false;
+  }
+  *value = (static_cast<uint32_t>(_reply[3]) << 24) | (static_cast<uint32_t>(_reply[4]) << 16) | (static_cast<uint32_t>(_reply[5]) << 8) | _reply[6];
+  return true;
+}
@@ -5,16 +5,13 @@
 
 #include <ArduinoJson.h>
 #include <AsyncJson.h>
+#include <BinaryProtocol.h>
 #include <thingy.h>
 
 #include <string>
 
 #define TAG "WebSite"
 
-#ifndef WSL_MAX_WS_CLIENTS
-  #define WSL_MAX_WS_CLIENTS DEFAULT_MAX_WS_CLIENTS
-#endif
-
 // gzipped website
 extern const uint8_t thingy_html_start[] asm("_binary__pio_embed_website_html_gz_start");
 extern const uint8_t thingy_html_end[] asm("_binary__pio_embed_website_html_gz_end");
@@ -48,6 +45,10 @@ void WebSite::end() {
     _webServer->removeHandler(_ws);
     _ws = nullptr;
   }
+  _clientsMutex.lock();
+  for (ClientSlot& slot : _clients)
+    slot = {};
+  _clientsMutex.unlock();
 
 #ifdef MYCILA_WEBSERIAL_SUPPORT_APP
   webSerial.end();
@@ -73,6 +74,12 @@ void WebSite::_webSiteCallback() {
 
   _ws->onEvent([&](__unused AsyncWebSocket* server, AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, __unused size_t len) -> void {
     if (type == WS_EVT_CONNECT) {
+      // more clients than slots are turned away (the oldest are closed by cleanupClients)
+      if (!_addClient(client->id())) {
+        LOGW(TAG, "Too many clients!");
+        client->close();
+        return;
+      }
       client->keepAlivePeriod(10);
       client->setCloseClientOnQueueFull(true);
 
@@ -80,17 +87,32 @@ void WebSite::_webSiteCallback() {
       JsonDocument jsonMsg;
       jsonMsg["type"] = "initial_config";
       jsonMsg["id"] = client->id();
-      jsonMsg["config"]["autoHome"] = stepper.getAutoHome();
+      // (the state of the stepper is taken from the event bus, it's owned by the motion task)
+      JsonDocument configMsg;
+      _toJson(eventBus.getSnapshot(MotorEvent::Type::CONFIG), &configMsg);
+      configMsg.remove("type");
+      jsonMsg["config"] = configMsg;
+      MotorEvent thermal = eventBus.getSnapshot(MotorEvent::Type::THERMAL);
+      jsonMsg["thermal"]["state"] = stepper.getThermalState_as_string(static_cast<Stepper::ThermalState>(thermal.thermal.state));
+      jsonMsg["thermal"]["derating"] = thermal.thermal.derating;
+      // (plain reads of flags and counters)
       jsonMsg["homing_state"] = stepper.getHomingState_as_string().c_str();
-      jsonMsg["motor_state"]["move_state"]["position"] = stepper.getCurrentPosition();
-      jsonMsg["motor_state"]["move_state"]["speed"] = stepper.getCurrentSpeed();
-      jsonMsg["motor_state"]["state"] = stepper.getMotorState_as_string().c_str();
-      jsonMsg["motor_state"]["destination"]["position"] = stepper.getDestinationPosition();
-      jsonMsg["motor_state"]["destination"]["speed"] = stepper.getDestinationSpeed();
-      jsonMsg["motor_state"]["destination"]["acceleration"] = stepper.getDestinationAcceleration();
+      jsonMsg["diagnostics"]["homeStopLatency"] = stepper.getHomeStopLatencyMax();
+      jsonMsg["diagnostics"]["homeTaskLatency"] = stepper.getHomeTaskLatencyMax();
+      MotorEvent moveState = eventBus.getSnapshot(MotorEvent::Type::MOVE_STATE);
+      jsonMsg["motor_state"]["move_state"]["position"] = moveState.moveState.position;
+      jsonMsg["motor_state"]["move_state"]["speed"] = moveState.moveState.speed;
+      MotorEvent motorState = eventBus.getSnapshot(MotorEvent::Type::MOTOR_STATE);
+      jsonMsg["motor_state"]["state"] = stepper.getMotorState_as_string(static_cast<Stepper::MotorState>(_persistentState(motorState)));
+      jsonMsg["motor_state"]["destination"]["position"] = motorState.destination.position;
+      jsonMsg["motor_state"]["destination"]["speed"] = motorState.destination.speed;
+      jsonMsg["motor_state"]["destination"]["acceleration"] = motorState.destination.acceleration;
+      jsonMsg["motor_state"]["destination"]["jerk"] = motorState.destination.jerk;
       AsyncWebSocketMessageBuffer* buffer = new AsyncWebSocketMessageBuffer(measureJson(jsonMsg));
       serializeJson(jsonMsg, buffer->get(), buffer->length());
       client->text(buffer);
+    } else if (type == WS_EVT_DISCONNECT) {
+      _removeClient(client->id());
     } else if (type == WS_EVT_DATA) {
       // Try handling the data
       try {
@@ -99,16 +121,30 @@ void WebSite::_webSiteCallback() {
           if (info->opcode == WS_TEXT) {
             data[len] = 0;
           }
-          // pong on client keep-alive message
-          if (strcmp(reinterpret_cast<char*>(data), "ping") == 0) {
+          if (info->opcode == WS_BINARY) { // binary command frame
+            MotorCommand command;
+            if (!BinaryProtocol::decodeCommand(data, len, client->id(), &command)) {
+              LOGW(TAG, "Invalid binary frame received!");
+            } else if (_webEventCallback != nullptr) {
+              _webEventCallback(command);
+            } else {
+              LOGE(TAG, "No event listener (_webEventCallback) available!");
+            }
+          } else if (strcmp(reinterpret_cast<char*>(data), "ping") == 0) { // pong on client keep-alive message
             client->text("pong");
           } else { // some message is received
             JsonDocument jsonRXMsg;
             DeserializationError error = deserializeJson(jsonRXMsg, reinterpret_cast<char*>(data));
             if (error == DeserializationError::Ok) {
-              // ...pass command to stepper and let it decide...
-              if (_webEventCallback != nullptr) {
-                _webEventCallback(jsonRXMsg);
+              // ...negotiate the protocol for this client...
+              if (jsonRXMsg["type"].is<const char*>() && strcmp(jsonRXMsg["type"].as<const char*>(), "protocol") == 0) {
+                bool binary = jsonRXMsg["binary"] | false;
+                _setBinaryClient(client->id(), binary);
+                client->text(binary ? "{\"type\":\"protocol\",\"binary\":true}" : "{\"type\":\"protocol\",\"binary\":false}");
+              } else if (_webEventCallback != nullptr) { // ...pass command to stepper and let it decide...
+                MotorCommand command;
+                _fromJson(jsonRXMsg, jsonRXMsg["origin"].as<int32_t>(), &command);
+                _webEventCallback(command);
               } else {
                 LOGE(TAG, "No event listener (_webEventCallback) available!");
               }
@@ -155,9 +191,9 @@ void WebSite::_webSiteCallback() {
               request->send(response); })
     .setFilter([](__unused AsyncWebServerRequest* request) { return eventHandler.getNetworkState() != Mycila::ESPConnect::State::PORTAL_STARTED; });
 
-  // register event handlers to stepper
-  LOGD(TAG, "register event handlers to stepper");
-  stepper.listenMotorEvent([&](JsonDocument doc) { _motorEventCallback(doc); });
+  // subscribe to motor events
+  LOGD(TAG, "subscribe to motor events");
+  eventBus.subscribe([&](const MotorEvent& event) { _motorEventCallback(event); });
 
   // set up a task to cleanup orphan websock-clients
   _disconnectTime = millis();
@@ -170,15 +206,338 @@ void WebSite::_webSiteCallback() {
 
 // Handle events from motor
 // just forward the event to the website client(s)
-void WebSite::_motorEventCallback(JsonDocument doc) {
+// (the event is serialized here, only when someone is listening)
+void WebSite::_motorEventCallback(const MotorEvent& event) {
+  if (_ws == nullptr)
+    return;
   _ws->cleanupClients(WSL_MAX_WS_CLIENTS);
-  if (_ws->count()) {
+  if (!_ws->count())
+    return;
+
+  // the slots are copied (on the stack), clients might change while sending
+  ClientSlot clients[WSL_MAX_WS_CLIENTS];
+  bool binary = false;
+  {
+    std::lock_guard<std::mutex> lock(_clientsMutex);
+    for (size_t i = 0; i < WSL_MAX_WS_CLIENTS; i++) {
+      clients[i] = _clients[i];
+      binary |= _clients[i].id != 0 && _clients[i].binary;
+    }
+  }
+
+  // JSON for everybody
+  uint8_t frame[BinaryProtocol::MAX_FRAME_LENGTH];
+  size_t frameLength = binary ? BinaryProtocol::encodeEvent(event, frame) : 0;
+  if (frameLength == 0) {
+    JsonDocument doc;
+    _toJson(event, &doc);
     AsyncWebSocketMessageBuffer* buffer = new AsyncWebSocketMessageBuffer(measureJson(doc));
     serializeJson(doc, buffer->get(), buffer->length());
     _ws->textAll(buffer);
+    return;
+  }
+
+  // binary frames for those who asked for them, JSON (serialized once) for the others
+  // (sent by ID, the socket looks the client up under its lock)
+  std::string json;
+  for (const ClientSlot& slot : clients) {
+    if (slot.id == 0)
+      continue;
+    if (slot.binary) {
+      _ws->binary(slot.id, frame, frameLength);
+    } else {
+      if (json.empty()) {
+        JsonDocument doc;
+        _toJson(event, &doc);
+        serializeJson(doc, json);
+      }
+      _ws->text(slot.id, json.c_str(), json.length());
+    }
+  }
+}
+
+bool WebSite::_addClient(uint32_t clientID) {
+  std::lock_guard<std::mutex> lock(_clientsMutex);
+  for (ClientSlot& slot : _clients) {
+    if (slot.id == 0) {
+      slot = {clientID, false};
+      return true;
+    }
+  }
+  return false;
+}
+
+void WebSite::_removeClient(uint32_t clientID) {
+  std::lock_guard<std::mutex> lock(_clientsMutex);
+  for (ClientSlot& slot : _clients) {
+    if (slot.id == clientID)
+      slot = {};
+  }
+}
+
+void WebSite::_setBinaryClient(uint32_t clientID, bool binary) {
+  std::lock_guard<std::mutex> lock(_clientsMutex);
+  for (ClientSlot& slot : _clients) {
+    if (slot.id == clientID)
+      slot.binary = binary;
+  }
+}
+
+void WebSite::_fromJson(const JsonDocument& doc, int32_t clientID, MotorCommand* command) {
+  *command = {};
+  command->origin = clientID;
+  const char* type = doc["type"].as<const char*>();
+  if (type == nullptr) {
+    command->type = MotorCommand::Type::UNKNOWN;
+    return;
+  }
+
+  // optional values
+  if (doc["speed"].is<int32_t>())
+    command->options |= MotorCommand::SPEED;
+  if (doc["acceleration"].is<int32_t>())
+    command->options |= MotorCommand::ACCELERATION;
+  Stepper::ChopperMode chopperMode;
+  if (doc["chopper"].is<const char*>() && stepper.getChopperMode_from_string(doc["chopper"].as<const char*>(), &chopperMode)) {
+    command->options |= MotorCommand::CHOPPER_MODE;
+    command->chopperMode = static_cast<uint8_t>(chopperMode);
+  }
+
+  if (strcmp(type, "move") == 0) {
+    command->type = MotorCommand::Type::MOVE;
+    command->position = doc["position"].as<int32_t>();
+    command->speed = doc["speed"].as<int32_t>();
+    command->acceleration = doc["acceleration"].as<int32_t>();
+    command->jerk = doc["jerk"] | 0;
+  } else if (strcmp(type, "move_sequence") == 0) {
+    command->type = MotorCommand::Type::MOVE_SEQUENCE;
+    command->speed = doc["speed"] | 0;
+    command->acceleration = doc["acceleration"] | 0;
+    command->jerk = doc["jerk"] | 0;
+    JsonArrayConst waypoints = doc["waypoints"].as<JsonArrayConst>();
+    command->waypointCount = waypoints.size();
+    uint16_t i = 0;
+    for (JsonVariantConst waypoint : waypoints) {
+      if (i == PLANNER_MAX_WAYPOINTS)
+        break;
+      // a waypoint without a position makes the whole sequence unplausible (rejected by the stepper)
+      if (!waypoint["position"].is<int32_t>()) {
+        command->waypointCount = 0;
+        break;
+      }
+      // (negative values won't pass the checks of the stepper)
+      command->waypoints[i++] = {waypoint["position"].as<int32_t>(), waypoint["speed"] | 0, waypoint["acceleration"] | 0};
+    }
+  } else if (strcmp(type, "jog") == 0) {
+    command->type = MotorCommand::Type::JOG;
+    command->speed = doc["speed"].as<int32_t>();
+    command->acceleration = doc["acceleration"] | 0;
+  } else if (strcmp(type, "stop") == 0) {
+    command->type = MotorCommand::Type::STOP;
+  } else if (strcmp(type, "home") == 0) {
+    command->type = MotorCommand::Type::HOME;
+  } else if (strcmp(type, "calibrate") == 0) {
+    command->type = MotorCommand::Type::CALIBRATE;
+  } else if (strcmp(type, "characterize") == 0) {
+    command->type = MotorCommand::Type::CHARACTERIZE;
+  } else if (strcmp(type, "tune_chopper") == 0) {
+    command->type = MotorCommand::Type::TUNE_CHOPPER;
+  } else if (strcmp(type, "calibrate_shaper") == 0) {
+    command->type = MotorCommand::Type::CALIBRATE_SHAPER;
+  } else if (strcmp(type, "map_resonances") == 0) {
+    command->type = MotorCommand::Type::MAP_RESONANCES;
+  } else if (strcmp(type, "update_config") == 0) {
+    command->type = MotorCommand::Type::UPDATE_CONFIG;
+    if (doc["autoHome"].is<bool>()) {
+      command->options |= MotorCommand::AUTO_HOME;
+      command->config.autoHome = doc["autoHome"].as<bool>();
+    }
+    if (doc["jogTimeout"].is<uint32_t>()) {
+      command->options |= MotorCommand::JOG_TIMEOUT;
+      command->config.jogTimeout = doc["jogTimeout"].as<uint32_t>();
+    }
+    if (doc["positionDeadband"].is<uint32_t>()) {
+      command->options |= MotorCommand::POSITION_DEADBAND;
+      command->config.positionDeadband = doc["positionDeadband"].as<uint32_t>();
+    }
+    if (doc["speedDeadband"].is<uint32_t>()) {
+      command->options |= MotorCommand::SPEED_DEADBAND;
+      command->config.speedDeadband = doc["speedDeadband"].as<uint32_t>();
+    }
+    if (doc["holdPosition"].is<bool>()) {
+      command->options |= MotorCommand::HOLD_POSITION;
+      command->config.holdPosition = doc["holdPosition"].as<bool>();
+    }
+    Stepper::HomingMode homingMode;
+    if (doc["homingMode"].is<const char*>() && stepper.getHomingMode_from_string(doc["homingMode"].as<const char*>(), &homingMode)) {
+      command->options |= MotorCommand::HOMING_MODE;
+      command->config.homingMode = static_cast<uint8_t>(homingMode);
+    }
+    if (doc["maxSpeed"].is<int32_t>()) {
+      command->options |= MotorCommand::MAX_SPEED;
+      command->config.maxSpeed = doc["maxSpeed"].as<int32_t>();
+    }
+    if (doc["maxAcceleration"].is<int32_t>()) {
+      command->options |= MotorCommand::MAX_ACCELERATION;
+      command->config.maxAcceleration = doc["maxAcceleration"].as<int32_t>();
+    }
+    if (doc["stallThreshold"].is<uint8_t>()) {
+      command->options |= MotorCommand::STALL_THRESHOLD;
+      command->config.stallThreshold = doc["stallThreshold"].as<uint8_t>();
+    }
+    MotionPlanner::Shaper shaper;
+    if (doc["shaper"].is<const char*>() && stepper.getShaper_from_string(doc["shaper"].as<const char*>(), &shaper)) {
+      command->options |= MotorCommand::SHAPER;
+      command->config.shaper = static_cast<uint8_t>(shaper);
+    }
+    if (doc["shaperFrequency"].is<float>()) {
+      command->options |= MotorCommand::SHAPER_FREQUENCY;
+      command->config.shaperFrequency = doc["shaperFrequency"].as<float>();
+    }
+    if (doc["shaperDamping"].is<float>()) {
+      command->options |= MotorCommand::SHAPER_DAMPING;
+      command->config.shaperDamping = doc["shaperDamping"].as<float>();
+    }
+    // the speeds are taken to their bins (an empty array clears the map)
+    if (doc["resonances"].is<JsonArrayConst>()) {
+      command->options |= MotorCommand::RESONANCE_MAP;
+      command->config.resonanceMap = 0;
+      for (JsonVariantConst speed : doc["resonances"].as<JsonArrayConst>()) {
+        int32_t bin = (speed.as<int32_t>() + RESONANCE_SPEED_STEP / 2) / RESONANCE_SPEED_STEP;
+        if (bin > 0 && bin < RESONANCE_BINS)
+          command->config.resonanceMap |= 1ULL << bin;
+      }
+    }
+    if (doc["coolStepMin"].is<uint8_t>()) {
+      command->options |= MotorCommand::COOLSTEP_MIN;
+      command->config.coolStepMin = doc["coolStepMin"].as<uint8_t>();
+    }
+    if (doc["coolStepMax"].is<uint8_t>()) {
+      command->options |= MotorCommand::COOLSTEP_MAX;
+      command->config.coolStepMax = doc["coolStepMax"].as<uint8_t>();
+    }
+    if (doc["currentAcceleration"].is<uint8_t>()) {
+      command->options |= MotorCommand::CURRENT_ACCELERATION;
+      command->config.currentAcceleration = doc["currentAcceleration"].as<uint8_t>();
+    }
+    if (doc["currentCruise"].is<uint8_t>()) {
+      command->options |= MotorCommand::CURRENT_CRUISE;
+      command->config.currentCruise = doc["currentCruise"].as<uint8_t>();
+    }
+    if (doc["currentHold"].is<uint8_t>()) {
+      command->options |= MotorCommand::CURRENT_HOLD;
+      command->config.currentHold = doc["currentHold"].as<uint8_t>();
+    }
+    if (doc["strokeLength"].is<int32_t>()) {
+      command->options |= MotorCommand::STROKE_LENGTH;
+      command->config.strokeLength = doc["strokeLength"].as<int32_t>();
+    }
+    Stepper::StallPolicy stallPolicy;
+    if (doc["stallPolicy"].is<const char*>() && stepper.getStallPolicy_from_string(doc["stallPolicy"].as<const char*>(), &stallPolicy)) {
+      command->options |= MotorCommand::STALL_POLICY;
+      command->config.stallPolicy = static_cast<uint8_t>(stallPolicy);
+    }
+  } else {
+    command->type = MotorCommand::Type::UNKNOWN;
+  }
+}
+
+void WebSite::_toJson(const MotorEvent& event, JsonDocument* doc) {
+  JsonDocument& jsonMsg = *doc;
+  switch (event.type) {
+    case MotorEvent::Type::MOVE_STATE:
+      jsonMsg["type"] = "move_state";
+      jsonMsg["position"] = event.moveState.position;
+      jsonMsg["speed"] = event.moveState.speed;
+      jsonMsg["currentScale"] = event.moveState.currentScale;
+      break;
+
+    case MotorEvent::Type::CONFIG:
+      jsonMsg["type"] = "config";
+      jsonMsg["autoHome"] = event.config.autoHome;
+      jsonMsg["jogTimeout"] = event.config.jogTimeout;
+      jsonMsg["positionDeadband"] = event.config.positionDeadband;
+      jsonMsg["speedDeadband"] = event.config.speedDeadband;
+      jsonMsg["holdPosition"] = event.config.holdPosition;
+      jsonMsg["homingMode"] = stepper.getHomingMode_as_string(static_cast<Stepper::HomingMode>(event.config.homingMode));
+      jsonMsg["stallThreshold"] = event.config.stallThreshold;
+      jsonMsg["strokeLength"] = event.config.strokeLength;
+      jsonMsg["maxSpeed"] = event.config.maxSpeed;
+      jsonMsg["maxAcceleration"] = event.config.maxAcceleration;
+      jsonMsg["stealthChopThreshold"] = event.config.stealthChopThreshold;
+      jsonMsg["coolStepThreshold"] = event.config.coolStepThreshold;
+      jsonMsg["shaper"] = stepper.getShaper_as_string(static_cast<MotionPlanner::Shaper>(event.config.shaper));
+      jsonMsg["shaperFrequency"] = event.config.shaperFrequency;
+      jsonMsg["shaperDamping"] = event.config.shaperDamping;
+      _resonancesToJson(event.config.resonanceMap, jsonMsg["resonances"].to<JsonArray>());
+      jsonMsg["coolStepMin"] = event.config.coolStepMin;
+      jsonMsg["coolStepMax"] = event.config.coolStepMax;
+      jsonMsg["currentAcceleration"] = event.config.currentAcceleration;
+      jsonMsg["currentCruise"] = event.config.currentCruise;
+      jsonMsg["currentHold"] = event.config.currentHold;
+      jsonMsg["stallPolicy"] = stepper.getStallPolicy_as_string(static_cast<Stepper::StallPolicy>(event.config.stallPolicy));
+      if (event.parts & MotorEvent::ORIGIN)
+        jsonMsg["origin"] = event.origin;
+      break;
+
+    case MotorEvent::Type::THERMAL:
+      jsonMsg["type"] = "thermal";
+      jsonMsg["state"] = stepper.getThermalState_as_string(static_cast<Stepper::ThermalState>(event.thermal.state));
+      jsonMsg["derating"] = event.thermal.derating;
+      jsonMsg["maxSpeed"] = event.thermal.maxSpeed;
+      jsonMsg["maxAcceleration"] = event.thermal.maxAcceleration;
+      break;
+
+    case MotorEvent::Type::MOTOR_STATE:
+      jsonMsg["type"] = "motor_state";
+      if (event.parts & MotorEvent::ORIGIN)
+        jsonMsg["origin"] = event.origin;
+      jsonMsg["state"] = stepper.getMotorState_as_string(static_cast<Stepper::MotorState>(event.state));
+      if (event.warning != nullptr)
+        jsonMsg["warning"] = event.warning;
+      if (event.error != nullptr)
+        jsonMsg["error"] = event.error;
+      if (event.parts & MotorEvent::MOVE_STATE) {
+        jsonMsg["move_state"]["position"] = event.moveState.position;
+        jsonMsg["move_state"]["speed"] = event.moveState.speed;
+      }
+      if (event.parts & MotorEvent::DESTINATION) {
+        jsonMsg["destination"]["position"] = event.destination.position;
+        jsonMsg["destination"]["speed"] = event.destination.speed;
+        jsonMsg["destination"]["acceleration"] = event.destination.acceleration;
+        jsonMsg["destination"]["jerk"] = event.destination.jerk;
+      }
+      if (event.parts & MotorEvent::JOG) {
+        jsonMsg["jog"]["speed"] = event.jog.speed;
+        jsonMsg["jog"]["acceleration"] = event.jog.acceleration;
+      }
+      if (event.parts & MotorEvent::WAYPOINTS)
+        jsonMsg["waypoints"] = event.waypoints;
+      break;
   }
 }
 
 void WebSite::_wsCleanupCallback() {
   _ws->cleanupClients(WSL_MAX_WS_CLIENTS);
 }
+
+// temporary states (HOMED, ARRIVED,...) have gone back to the one the motor was in
+uint8_t WebSite::_persistentState(const MotorEvent& event) {
+  switch (static_cast<Stepper::MotorState>(event.state)) {
+    case Stepper::MotorState::HOMED:
+    case Stepper::MotorState::ARRIVED:
+    case Stepper::MotorState::STOPPED:
+      return static_cast<uint8_t>(Stepper::MotorState::IDLE);
+    case Stepper::MotorState::WARNING:
+      return event.motorState;
+    default:
+      return event.state;
+  }
+}
+
+void WebSite::_resonancesToJson(uint64_t resonanceMap, JsonArray resonances) {
+  for (uint8_t bin = 0; bin < RESONANCE_BINS; bin++) {
+    if ((resonanceMap >> bin) & 1)
+      resonances.add(bin * RESONANCE_SPEED_STEP);
+  }
+}
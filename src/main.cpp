@@ -14,12 +14,25 @@ AsyncWebServer webServer(HTTP_PORT);
 Scheduler scheduler;
 ESPNetwork espNetwork(webServer);
 EventHandler eventHandler(espNetwork);
+EventBus eventBus;
 WebServerAPI webServerAPI(webServer);
 WebSite webSite(webServer);
 LED led;
 Stepper stepper;
 FastAccelStepperEngine engine = FastAccelStepperEngine();
 
+#ifdef MOTION_TASK
+// The stepper runs on its own scheduler in a dedicated task
+Scheduler motionScheduler;
+void motionTask(__unused void* parameter) {
+  while (true) {
+    motionScheduler.execute();
+    // let lower priority tasks run (a tick is 1ms)
+    vTaskDelay(1);
+  }
+}
+#endif
+
 // Allow logging for app via serial
 #if defined(MYCILA_LOGGER_SUPPORT_APP)
 Mycila::Logger* serialLogger = nullptr;
@@ -63,11 +76,19 @@ void setup() {
   // Add WebServerAPI to Scheduler
   webServerAPI.begin(&scheduler);
 
+  // Add EventBus to Scheduler
+  eventBus.begin(&scheduler);
+
   // Add WebSite to Scheduler
   webSite.begin(&scheduler);
 
   // Add Stepper to Scheduler
+#ifdef MOTION_TASK
+  stepper.begin(&motionScheduler, &scheduler);
+  xTaskCreatePinnedToCore(motionTask, "motionTask", MOTION_TASK_STACK_SIZE, NULL, MOTION_TASK_PRIORITY, NULL, MOTION_TASK_CORE);
+#else
   stepper.begin(&scheduler);
+#endif
 }
 
 void loop() {